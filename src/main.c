@@ -4,15 +4,20 @@
 #include <zephyr/devicetree.h>
 #include <zephyr/drivers/can.h>
 #include <zephyr/drivers/gpio.h>
+#include <zephyr/drivers/spi.h>
 #include <zephyr/types.h>
 #include <stddef.h>
+#include <string.h>
 #include <errno.h>
 #include <zephyr/bluetooth/bluetooth.h>
 #include <zephyr/bluetooth/hci.h>
 #include <zephyr/bluetooth/conn.h>
 #include <zephyr/bluetooth/uuid.h>
 #include <zephyr/bluetooth/gatt.h>
+#include <zephyr/bluetooth/l2cap.h>
 #include <zephyr/sys/byteorder.h>
+#include <zephyr/settings/settings.h>
+#include <sdc_hci_vs.h>
 
 #include "ttpms_common.h"
 
@@ -24,7 +29,7 @@ LOG_MODULE_REGISTER(ttpms);
 
 // How we keep track of state.
 // Use Zephyr atomic set, clear, test functions.
-ATOMIC_DEFINE(flags, 18);
+ATOMIC_DEFINE(flags, 23);
 #define IFL_CONNECTED_FLAG		0
 #define IFR_CONNECTED_FLAG		1
 #define IRL_CONNECTED_FLAG		2
@@ -43,6 +48,11 @@ ATOMIC_DEFINE(flags, 18);
 #define EFR_SUBSCRIBED_FLAG		15
 #define ERL_SUBSCRIBED_FLAG		16
 #define ERR_SUBSCRIBED_FLAG		17
+#define CAN_BUS_OFF_FLAG		18
+#define IFL_PRES_SUBSCRIBED_FLAG	19	// only the internal sensors have pressure
+#define IFR_PRES_SUBSCRIBED_FLAG	20
+#define IRL_PRES_SUBSCRIBED_FLAG	21
+#define IRR_PRES_SUBSCRIBED_FLAG	22
 
 
 
@@ -56,741 +66,3555 @@ ATOMIC_DEFINE(flags, 18);
 
 // This frame is sent by dash or other controller to enable & configure TTPMS
 // 0th byte:	0th bit = temp enable	1th bit = pressure enable
+// 1-2th bytes:	(optional) total TTPMS CAN budget in frames/s, uint16_t little endian (0 = CONFIG_TTPMS_CAN_BUDGET_TOTAL)
 #define TTPMS_SETTINGS_FRAME_ID TTPMS_CAN_BASE_ID	// not creating a can_frame struct because we will only be receiving this
 
 // This frame is sent out by TTPMS RX to indicate general data
 // 0th byte:	0th bit = temp enabled	1th bit = pressure enabled
-// 1th byte:	connected sensors (0th bit = IFL .... 7th bit = ERR)
-struct can_frame TTPMS_status = {.flags = 0, .id = TTPMS_CAN_BASE_ID + 1, .dlc = 2};
+// 1th byte:	connected sensors (0th bit = IFL .... 7th bit = ERR, positions that aren't fitted stay 0)
+// 2-3th bytes:	measured bus load caused by TTPMS, uint16_t little endian with 0.1% scale
+#define TTPMS_STATUS_FRAME_ID	(TTPMS_CAN_BASE_ID + 1)
+#define TTPMS_STATUS_LEN		4
 
 // All temp values are uint8_t with 0.5 scale and 0 offset
-// Each CAN frame can only hold 8 data bytes. Thus multiple frames are needed for each full sensor reading
-
-// Internal front left (16 temp pixels + 24-bit pressure)
-struct can_frame IFL_temp_1 = {.flags = 0, .id = TTPMS_CAN_BASE_ID + 2, .dlc = 8};
-struct can_frame IFL_temp_2 = {.flags = 0, .id = TTPMS_CAN_BASE_ID + 3, .dlc = 8};
-struct can_frame FL_pressure = {.flags = 0, .id = TTPMS_CAN_BASE_ID + 4, .dlc = 3};
- 
-// Internal front right (16 temp pixels + 24-bit pressure)
-struct can_frame IFR_temp_1 = {.flags = 0, .id = TTPMS_CAN_BASE_ID + 5, .dlc = 8};
-struct can_frame IFR_temp_2 = {.flags = 0, .id = TTPMS_CAN_BASE_ID + 6, .dlc = 8};
-struct can_frame FR_pressure = {.flags = 0, .id = TTPMS_CAN_BASE_ID + 7, .dlc = 3};
-
-// Internal rear left (16 temp pixels + 24-bit pressure)
-struct can_frame IRL_temp_1 = {.flags = 0, .id = TTPMS_CAN_BASE_ID + 8, .dlc = 8};
-struct can_frame IRL_temp_2 = {.flags = 0, .id = TTPMS_CAN_BASE_ID + 9, .dlc = 8};
-struct can_frame RL_pressure = {.flags = 0, .id = TTPMS_CAN_BASE_ID + 10, .dlc = 3};
-
-// Internal rear right (16 temp pixels + 24-bit pressure)
-struct can_frame IRR_temp_1 = {.flags = 0, .id = TTPMS_CAN_BASE_ID + 11, .dlc = 8};
-struct can_frame IRR_temp_2 = {.flags = 0, .id = TTPMS_CAN_BASE_ID + 12, .dlc = 8};
-struct can_frame RR_pressure = {.flags = 0, .id = TTPMS_CAN_BASE_ID + 13, .dlc = 3};
-
-// External front left (32 temp pixels)
-struct can_frame EFL_temp_1 = {.flags = 0, .id = TTPMS_CAN_BASE_ID + 14, .dlc = 8};
-struct can_frame EFL_temp_2 = {.flags = 0, .id = TTPMS_CAN_BASE_ID + 15, .dlc = 8};
-struct can_frame EFL_temp_3 = {.flags = 0, .id = TTPMS_CAN_BASE_ID + 16, .dlc = 8};
-struct can_frame EFL_temp_4 = {.flags = 0, .id = TTPMS_CAN_BASE_ID + 17, .dlc = 8};
-
-// External front right (32 temp pixels)
-struct can_frame EFR_temp_1 = {.flags = 0, .id = TTPMS_CAN_BASE_ID + 18, .dlc = 8};
-struct can_frame EFR_temp_2 = {.flags = 0, .id = TTPMS_CAN_BASE_ID + 19, .dlc = 8};
-struct can_frame EFR_temp_3 = {.flags = 0, .id = TTPMS_CAN_BASE_ID + 20, .dlc = 8};
-struct can_frame EFR_temp_4 = {.flags = 0, .id = TTPMS_CAN_BASE_ID + 21, .dlc = 8};
-
-// External rear left (16 temp pixels)
-struct can_frame ERL_temp_1 = {.flags = 0, .id = TTPMS_CAN_BASE_ID + 22, .dlc = 8};
-struct can_frame ERL_temp_2 = {.flags = 0, .id = TTPMS_CAN_BASE_ID + 23, .dlc = 8};
-
-// External rear right (16 temp pixels)
-struct can_frame ERR_temp_1 = {.flags = 0, .id = TTPMS_CAN_BASE_ID + 24, .dlc = 8};
-struct can_frame ERR_temp_2 = {.flags = 0, .id = TTPMS_CAN_BASE_ID + 25, .dlc = 8};
+// Each CAN frame can only hold 8 data bytes. Thus multiple frames (with consecutive IDs) are needed for each
+// full sensor reading. Only the first ID is defined below, see the sensor table for how many frames follow.
+// The IDs come from the sensor topology (Kconfig): each fitted sensor's temp frames, followed by its pressure frame for
+// internal sensors, in the order below with no gaps. With all eight fitted and the default pixel counts this is the
+// ttpms_rx_2_0 layout (IFL temp at base + 2 .... ERR temp at base + 24, diagnostics at base + 26).
+
+#define TTPMS_FITTED(pos)		IS_ENABLED(CONFIG_TTPMS_SENSOR_##pos)
+
+#define TTPMS_INTERNAL_FRAMES		DIV_ROUND_UP(CONFIG_TTPMS_INTERNAL_PIXELS, CAN_MAX_DLEN)
+#define TTPMS_EXTERNAL_FRONT_FRAMES	DIV_ROUND_UP(CONFIG_TTPMS_EXTERNAL_FRONT_PIXELS, CAN_MAX_DLEN)
+#define TTPMS_EXTERNAL_REAR_FRAMES	DIV_ROUND_UP(CONFIG_TTPMS_EXTERNAL_REAR_PIXELS, CAN_MAX_DLEN)
+
+// Internal front left (CONFIG_TTPMS_INTERNAL_PIXELS temp pixels + 24-bit pressure)
+#define IFL_TEMP_FRAME_ID		(TTPMS_CAN_BASE_ID + 2)
+#define FL_PRESSURE_FRAME_ID	(IFL_TEMP_FRAME_ID + TTPMS_INTERNAL_FRAMES)		// dlc = 3
+
+// Internal front right
+#define IFR_TEMP_FRAME_ID		(IFL_TEMP_FRAME_ID + TTPMS_FITTED(IFL) * (TTPMS_INTERNAL_FRAMES + 1))
+#define FR_PRESSURE_FRAME_ID	(IFR_TEMP_FRAME_ID + TTPMS_INTERNAL_FRAMES)
+
+// Internal rear left
+#define IRL_TEMP_FRAME_ID		(IFR_TEMP_FRAME_ID + TTPMS_FITTED(IFR) * (TTPMS_INTERNAL_FRAMES + 1))
+#define RL_PRESSURE_FRAME_ID	(IRL_TEMP_FRAME_ID + TTPMS_INTERNAL_FRAMES)
+
+// Internal rear right
+#define IRR_TEMP_FRAME_ID		(IRL_TEMP_FRAME_ID + TTPMS_FITTED(IRL) * (TTPMS_INTERNAL_FRAMES + 1))
+#define RR_PRESSURE_FRAME_ID	(IRR_TEMP_FRAME_ID + TTPMS_INTERNAL_FRAMES)
+
+// All pressure values are uint24_t little endian, passed through as sent by the sensor
+
+// External front left (CONFIG_TTPMS_EXTERNAL_FRONT_PIXELS temp pixels)
+#define EFL_TEMP_FRAME_ID		(IRR_TEMP_FRAME_ID + TTPMS_FITTED(IRR) * (TTPMS_INTERNAL_FRAMES + 1))
+
+// External front right
+#define EFR_TEMP_FRAME_ID		(EFL_TEMP_FRAME_ID + TTPMS_FITTED(EFL) * TTPMS_EXTERNAL_FRONT_FRAMES)
+
+// External rear left (CONFIG_TTPMS_EXTERNAL_REAR_PIXELS temp pixels)
+#define ERL_TEMP_FRAME_ID		(EFR_TEMP_FRAME_ID + TTPMS_FITTED(EFR) * TTPMS_EXTERNAL_FRONT_FRAMES)
+
+// External rear right
+#define ERR_TEMP_FRAME_ID		(ERL_TEMP_FRAME_ID + TTPMS_FITTED(ERL) * TTPMS_EXTERNAL_REAR_FRAMES)
+
+#define TTPMS_SENSOR_FRAMES_END	(ERR_TEMP_FRAME_ID + TTPMS_FITTED(ERR) * TTPMS_EXTERNAL_REAR_FRAMES)
+
+// This frame is sent out by TTPMS RX at a low rate to show how CAN is doing, one row per frame. Counters wrap.
+// Row numbers are fixed whatever the sensor topology, rows of positions that aren't fitted are skipped.
+// Rows 0-7 are the sensors' temp (IFL .... ERR), row 8 is the status frame, row 9 is this frame,
+// rows 10-13 are the pressures (FL .... RR):
+// 0th byte:	row
+// 1-2th bytes:	frames sent, uint16_t little endian
+// 3th byte:	frames abandoned because no TX buffer freed up within TTPMS_CAN_TX_TIMEOUT
+// 4th byte:	frames lost to other CAN TX errors
+// 5-6th bytes:	samples coalesced (replaced before they were sent, incl. held back by the governor), uint16_t little endian
+// 7th byte:	bits 2-7 = longest the source had a sample waiting before the TX thread took it, 10ms scale (saturates),
+//				bits 0-1 = most frames handed to the MCP2515 and not yet done at once
+// Row 14 is CAN RX:
+// 0th byte:	row
+// 1-2th bytes:	MCP2515 interrupts (RX, TX done and errors), uint16_t little endian
+// 3-4th bytes:	frames received that passed our filters, uint16_t little endian
+// 5-6th bytes:	estimated frames rejected in software (interrupts not explained by TX or accepted RX), uint16_t little endian
+// 7th byte:	1 if the MCP2515 hardware acceptance filters are in use
+// Row 15 is CAN bus state:
+// 0th byte:	row
+// 1th byte:	controller state (0 = error active, 1 = error warning, 2 = error passive, 3 = bus-off, 4 = stopped)
+// 2th byte:	transmit error counter (TEC)
+// 3th byte:	receive error counter (REC)
+// 4-5th bytes:	state transitions, uint16_t little endian
+// 6th byte:	bus-off events
+// 7th byte:	controller restarts done by bus-off recovery
+// Rows 16-23 are the sensors' BLE links (IFL .... ERR):
+// 0th byte:	row
+// 1th byte:	connection state (0 = not connected since boot, 1 = lost, 2 = connected)
+// 2-3th bytes:	reconnects, uint16_t little endian
+// 4-5th bytes:	time it took to reconnect last time, 10ms scale, uint16_t little endian (saturates)
+// 6-7th bytes:	longest time to reconnect, 10ms scale, uint16_t little endian (saturates)
+// Rows 24-31 are the sensors' BLE radio (IFL .... ERR):
+// 0th byte:	row
+// 1th byte:	PHY (0 = not connected, 1 = 1M, 2 = 2M, 4 = Coded)
+// 2th byte:	RSSI, int8_t dBm (averaged)
+// 3-4th bytes:	connection events, uint16_t little endian
+// 5-6th bytes:	packets received with CRC errors, uint16_t little endian
+// 7th byte:	connection interval, 1.25ms scale
+// Rows 32-39 are the sensors' delivery (IFL .... ERR), loss/order/jitter need the sensor's sequence trailer:
+// 0th byte:	row
+// 1th byte:	RSSI, int8_t dBm (averaged)
+// 2th byte:	temp samples delivered per second (saturates)
+// 3-4th bytes:	samples lost in sequence gaps, uint16_t little endian
+// 5th byte:	sequence gaps (one or more samples missing)
+// 6th byte:	samples out of order (late or duplicate)
+// 7th byte:	inter-arrival jitter, ms (saturates)
+// Row 40 is the BLE channel map:
+// 0th byte:	row
+// 1-5th bytes:	host channel map, bit n = data channel n in use (as given to bt_le_set_chan_map)
+// 6th byte:	channels in use
+// 7th byte:	channel map updates
+// Rows 41-46 are BLE data channel quality, 7 channels per row (0-6, 7-13 .... 35-36):
+// 0th byte:	row
+// 1-7th bytes:	connection events with a CRC error or nothing received last period, % (255 = not enough events)
+// Rows 47-54 are the sensors' link state (IFL .... ERR):
+// 0th byte:	row
+// 1th byte:	link state (0 = idle, 1 = scanning, 2 = connected, 3 = discovering, 4 = subscribing, 5 = streaming,
+//				6 = unsubscribing)
+// 2-3th bytes:	time in that state, 100ms scale, uint16_t little endian (saturates)
+// 4-5th bytes:	connect to first notification last time, ms, uint16_t little endian (saturates)
+// 6-7th bytes:	longest connect to first notification, ms, uint16_t little endian (saturates)
+// Rows 55-62 are the sensors' time in each link state since boot (IFL .... ERR):
+// 0th byte:	row
+// 1-7th bytes:	% of uptime spent idle, scanning, connected, discovering, subscribing, streaming, unsubscribing
+#define TTPMS_DIAG_FRAME_ID		TTPMS_SENSOR_FRAMES_END
+#define TTPMS_DIAG_LEN			8
+
+// This frame is sent by dash or a laptop to tell TTPMS RX which sensor is at which position (kept in flash)
+// 0th byte:	position (0 = IFL .... 7 = ERR, positions that aren't fitted are ignored)
+// 1-6th bytes:	sensor BLE address (random static), least significant byte first (all 0 = back to the ttpms_common.h one)
+#define TTPMS_PROVISION_FRAME_ID	(TTPMS_DIAG_FRAME_ID + 1)	// not creating a can_frame struct, only received
+#define TTPMS_PROVISION_LEN			7
 
 const struct device *can_dev = DEVICE_DT_GET(DT_CHOSEN(zephyr_canbus));
 
+// MCP2515 INT line, we count edges on it to show the CPU/SPI load caused by CAN
+static const struct gpio_dt_spec mcp2515_int = GPIO_DT_SPEC_GET(DT_CHOSEN(zephyr_canbus), int_gpios);
+
+// SPI access to the MCP2515 that the driver doesn't offer (hardware acceptance filters)
+static const struct spi_dt_spec mcp2515_spi = SPI_DT_SPEC_GET(DT_CHOSEN(zephyr_canbus), SPI_WORD_SET(8), 0);
+
 const struct can_filter settings_frame_filter = {
         .flags = CAN_FILTER_DATA,
         .id = TTPMS_SETTINGS_FRAME_ID,
         .mask = CAN_STD_ID_MASK
 };
 
+const struct can_filter provision_frame_filter = {
+        .flags = CAN_FILTER_DATA,
+        .id = TTPMS_PROVISION_FRAME_ID,
+        .mask = CAN_STD_ID_MASK
+};
+
+// Total frames/s TTPMS may put on the bus, shared by all sensors and message classes (see CAN TX governor)
+atomic_t CAN_tx_budget_total = ATOMIC_INIT(CONFIG_TTPMS_CAN_BUDGET_TOTAL);
+
+void TTPMS_BLE_settings_changed(void);
+
 void settings_frame_cb(const struct device *dev, struct can_frame *frame, void *user_data)
 {
+	bool changed = false;
 
     if (frame->data[0] & 0x01) {
 		if(!atomic_test_and_set_bit(flags, TEMP_ENABLED_FLAG)) {
 			LOG_INF("Temperature ENABLED via CAN");
+			changed = true;
 		}
 	} else {
 		if(atomic_test_and_clear_bit(flags, TEMP_ENABLED_FLAG)) {
 			LOG_INF("Temperature DISABLED via CAN");
+			changed = true;
 		}
 	}
 
 	if (frame->data[0] & 0x02) {
 		if(!atomic_test_and_set_bit(flags, PRESSURE_ENABLED_FLAG)) {
 			LOG_INF("Pressure ENABLED via CAN");
+			changed = true;
 		}
 	} else {
 		if(atomic_test_and_clear_bit(flags, PRESSURE_ENABLED_FLAG)) {
 			LOG_INF("Pressure DISABLED via CAN");
+			changed = true;
+		}
+	}
+
+	// (un)subscribe right away rather than waiting for the main loop or the next notification
+	if (changed) {
+		TTPMS_BLE_settings_changed();
+	}
+
+	if (frame->dlc >= 3) {
+		uint16_t budget = sys_get_le16(&frame->data[1]);
+
+		if (budget == 0) {
+			budget = CONFIG_TTPMS_CAN_BUDGET_TOTAL;
+		}
+		if (atomic_set(&CAN_tx_budget_total, budget) != budget) {
+			LOG_INF("CAN budget set to %u frames/s via CAN", budget);
 		}
 	}
 }
 
-// The CAN frame structs are filled with data from BLE notification callback.
-// The filled frames are then sent here in system workqueue since can_send is blocking.
-// The TTPMS_can_send function is just to avoid repeating the error logging code a million times.
+void TTPMS_BLE_provision(uint8_t position, const uint8_t *addr);
+
+void provision_frame_cb(const struct device *dev, struct can_frame *frame, void *user_data)
+{
+	if (frame->dlc < TTPMS_PROVISION_LEN) {
+		LOG_WRN("Provisioning frame too short (%u bytes)", frame->dlc);
+		return;
+	}
+
+	TTPMS_BLE_provision(frame->data[0], &frame->data[1]);
+}
+
+// Sensor positions, the same whatever the topology. Everything on CAN is by position: the connected flags (and the
+// connected sensors byte of the status frame), the diagnostics rows and the provisioning frame.
+#define IFL_POSITION	0
+#define IFR_POSITION	1
+#define IRL_POSITION	2
+#define IRR_POSITION	3
+#define EFL_POSITION	4
+#define EFR_POSITION	5
+#define ERL_POSITION	6
+#define ERR_POSITION	7
+#define TTPMS_NUM_POSITIONS	8
+#define TTPMS_NUM_PRESSURE_POSITIONS	4	// IFL .... IRR
+
+// Sensor indices, same order as the positions. Only the fitted sensors get one, so everything sized by
+// TTPMS_NUM_SENSORS shrinks with the topology. Internal sensors come first, so their indices are also their pressure
+// numbers. The index of a position that isn't fitted is meaningless, see position_sensor.
+#define IFL_SENSOR		0
+#define IFR_SENSOR		(IFL_SENSOR + TTPMS_FITTED(IFL))
+#define IRL_SENSOR		(IFR_SENSOR + TTPMS_FITTED(IFR))
+#define IRR_SENSOR		(IRL_SENSOR + TTPMS_FITTED(IRL))
+#define EFL_SENSOR		(IRR_SENSOR + TTPMS_FITTED(IRR))
+#define EFR_SENSOR		(EFL_SENSOR + TTPMS_FITTED(EFL))
+#define ERL_SENSOR		(EFR_SENSOR + TTPMS_FITTED(EFR))
+#define ERR_SENSOR		(ERL_SENSOR + TTPMS_FITTED(ERL))
+#define TTPMS_NUM_SENSORS	(ERR_SENSOR + TTPMS_FITTED(ERR))
+#define TTPMS_NUM_PRESSURE	EFL_SENSOR	// one per internal sensor
+#define TTPMS_RX_SELF	TTPMS_NUM_SENSORS	// used for frames generated by the receiver itself (status frame)
+#define TTPMS_RX_DIAG	(TTPMS_RX_SELF + 1)	// used for the diagnostics frame, so it doesn't coalesce with the status frame
+#define TTPMS_RX_PRESSURE	(TTPMS_RX_DIAG + 1)	// first of the pressure sources, one per internal sensor
+
+BUILD_ASSERT(TTPMS_NUM_SENSORS > 0, "no sensor positions fitted (Kconfig sensor topology)");
+
+#define TTPMS_NOT_FITTED	UINT8_MAX
+#define TTPMS_POSITION_SENSOR(pos)	(TTPMS_FITTED(pos) ? pos##_SENSOR : TTPMS_NOT_FITTED)
+
+// Sensor index of each position, TTPMS_NOT_FITTED if the position isn't in the topology
+static const uint8_t position_sensor[TTPMS_NUM_POSITIONS] = {
+	[IFL_POSITION] = TTPMS_POSITION_SENSOR(IFL),
+	[IFR_POSITION] = TTPMS_POSITION_SENSOR(IFR),
+	[IRL_POSITION] = TTPMS_POSITION_SENSOR(IRL),
+	[IRR_POSITION] = TTPMS_POSITION_SENSOR(IRR),
+	[EFL_POSITION] = TTPMS_POSITION_SENSOR(EFL),
+	[EFR_POSITION] = TTPMS_POSITION_SENSOR(EFR),
+	[ERL_POSITION] = TTPMS_POSITION_SENSOR(ERL),
+	[ERR_POSITION] = TTPMS_POSITION_SENSOR(ERR),
+};
+
+#define TTPMS_CAN_TX_SOURCES	(TTPMS_RX_PRESSURE + TTPMS_NUM_PRESSURE)
+
+// CAN TX source of an internal sensor's pressure (pressure has its own mailbox so it doesn't coalesce with temp)
+#define TTPMS_PRESSURE_SOURCE(sensor)	(TTPMS_RX_PRESSURE + (sensor))
+
+// Each sensor (and TTPMS_RX_SELF, TTPMS_RX_DIAG, and each pressure) has a
+// "latest value" mailbox. A BLE notification copies its whole sample into the mailbox, replacing any
+// sample that hasn't been picked up by the CAN TX thread yet (older temperatures are worthless once a newer
+// one exists). Every overwrite is counted as coalesced. The CAN TX thread takes the freshest sample from
+// each pending mailbox in turn, so memory is bounded to one pending sample per sensor and a congested bus
+// only ever delays the newest sample, instead of growing a backlog of stale ones.
+// The mailbox is copied in and out under a spinlock, so a sample can never be torn or sent twice.
+
+// Frames are sent asynchronously so that all three MCP2515 TX buffers are kept loaded and frames go out
+// back-to-back. A mailbox's TX slot is released from the TX complete callback once all of its frames are done.
+// NOTE: with equal priority the MCP2515 sends from the highest numbered buffer first, so frames of one
+// sample may reach the bus out of order. Each frame has its own ID, so this doesn't matter to the dash/logger.
+
+#define TTPMS_CAN_TX_MAX_FRAMES	4	// most frames needed for one sample (32 pixels, the most the topology allows)
+#define TTPMS_CAN_TX_IN_FLIGHT	3	// frames handed to the driver at once (MCP2515 has 3 TX buffers)
+
+struct TTPMS_CAN_tx_slot {
+	uint8_t source;			// sensor index, TTPMS_RX_SELF, TTPMS_RX_DIAG or pressure source
+	uint8_t num_frames;
+	atomic_t in_flight;		// frames given to the driver whose TX callback hasn't run yet
+	struct can_frame frames[TTPMS_CAN_TX_MAX_FRAMES];
+};
+
+struct TTPMS_CAN_mailbox {
+	struct k_spinlock lock;
+	uint8_t num_frames;
+	uint32_t pending_since;	// k_uptime_get_32() when the mailbox last went from empty to holding a sample
+	struct can_frame latest[TTPMS_CAN_TX_MAX_FRAMES];	// newest sample, written by the producer
+	struct TTPMS_CAN_tx_slot tx;						// sample being sent, owned by the TX thread and callbacks
+};
+
+struct TTPMS_CAN_mailbox CAN_tx_mailbox[TTPMS_CAN_TX_SOURCES];
+
+// set when a mailbox holds a sample that the TX thread hasn't taken yet
+ATOMIC_DEFINE(CAN_tx_pending, TTPMS_CAN_TX_SOURCES);
+
+// given whenever there may be something for the TX thread to do
+K_SEM_DEFINE(CAN_tx_wake_sem, 0, 1);
+
+// one count per free MCP2515 TX buffer
+K_SEM_DEFINE(CAN_tx_in_flight_sem, TTPMS_CAN_TX_IN_FLIGHT, TTPMS_CAN_TX_IN_FLIGHT);
+
+// Counters for each CAN TX source, reported in the diagnostics frame
+struct TTPMS_CAN_tx_stats {
+	atomic_t queued;	// frames put in the mailbox
+	atomic_t sent;		// frames successfully sent
+	atomic_t abandoned;	// frames (or the rest of a sample) given up on because no TX buffer freed up in time
+	atomic_t errors;	// frames (or the rest of a sample) lost to any other CAN TX error
+	atomic_t coalesced;	// samples overwritten in the mailbox before they were sent
+	atomic_t wait_max_ms;	// longest this source had a sample waiting in its mailbox (coalesced ones included)
+	atomic_t in_flight_hwm;	// most frames of this source handed to the driver and not yet done at once
+};
+
+struct TTPMS_CAN_tx_stats CAN_tx_stats[TTPMS_CAN_TX_SOURCES];
+
+// Bits put on the bus by TTPMS (counted when a frame is handed to the driver), used to report our own bus load.
+// Worst case bit stuffing is assumed for a standard ID data frame (incl. 3 bit interframe space).
+#define CAN_FRAME_BITS(dlc)	(47 + 8 * (dlc) + (34 + 8 * (dlc) - 1) / 4)
+#define CAN_BITRATE			DT_PROP(DT_CHOSEN(zephyr_canbus), bus_speed)
+
+atomic_t CAN_tx_bits;
+
+// Frames the driver reported as failed, logged as a rate by TTPMS_CAN_log_stats (per source in the diagnostics frame)
+atomic_t CAN_tx_failed;
+atomic_t CAN_tx_last_error;
+
+// Called by the CAN driver (from its interrupt thread) once a frame has been sent or has failed. No logging here,
+// a bus fault fails every frame and would flood the log from the interrupt thread.
+void CAN_tx_done_cb(const struct device *dev, int error, void *user_data)
+{
+	struct TTPMS_CAN_tx_slot *slot = user_data;
+
+	if (error == 0) {
+		atomic_inc(&CAN_tx_stats[slot->source].sent);
+	} else {
+		atomic_inc(&CAN_tx_stats[slot->source].errors);
+		atomic_inc(&CAN_tx_failed);
+		atomic_set(&CAN_tx_last_error, error);
+	}
 
-// NOTE: This system should be changed, as the CAN frame data is not linked to each CAN send work event,
-// so if CAN messages become delayed more than ~120ms, the next BLE notification would overwrite the CAN frame data before the frame was sent with that data,
-// resulting in data loss and duplicate frames being sent. As a workaround, TTPMS_CAN_TX_TIMEOUT is used
+	k_sem_give(&CAN_tx_in_flight_sem);
 
-void TTPMS_CAN_send(const struct can_frame *frame)
+	// last frame of this sample, the TX thread may now send this mailbox's next sample
+	if (atomic_dec(&slot->in_flight) == 1 && atomic_test_bit(CAN_tx_pending, slot->source)) {
+		k_sem_give(&CAN_tx_wake_sem);
+	}
+}
+
+// The TTPMS_can_send function is just to avoid repeating the error logging code a million times.
+// Waits up to TTPMS_CAN_TX_TIMEOUT for a free TX buffer, then hands the frame to the driver without
+// waiting for it to be sent. Returns the error code so the caller can abandon the rest of the sample.
+int TTPMS_CAN_send(struct TTPMS_CAN_tx_slot *slot, int i)
 {
-	int err = can_send(can_dev, frame, TTPMS_CAN_TX_TIMEOUT, NULL, NULL);
-	if (err == -11) {
+	int err = k_sem_take(&CAN_tx_in_flight_sem, TTPMS_CAN_TX_TIMEOUT);
+	if (err == 0) {
+		atomic_inc(&slot->in_flight);
+		err = can_send(can_dev, &slot->frames[i], TTPMS_CAN_TX_TIMEOUT, CAN_tx_done_cb, slot);
+		if (err != 0) {
+			atomic_dec(&slot->in_flight);
+			k_sem_give(&CAN_tx_in_flight_sem);
+		} else {
+			atomic_val_t depth = atomic_get(&slot->in_flight) - 1;	// minus the TX thread's own reference
+
+			if (depth > atomic_get(&CAN_tx_stats[slot->source].in_flight_hwm)) {
+				atomic_set(&CAN_tx_stats[slot->source].in_flight_hwm, depth);
+			}
+			atomic_add(&CAN_tx_bits, CAN_FRAME_BITS(slot->frames[i].dlc));
+		}
+	}
+
+	if (err == -EAGAIN) {
 		LOG_WRN("Arbitration timeout, frame abandoned");
 	} else if (err != 0) {
 		LOG_ERR("Unknown CAN TX error, can_send returned: %d", err);
 	}
+	return err;
+}
+
+// total time the CAN TX thread has spent blocked waiting for a TX buffer, in microseconds
+atomic_t CAN_tx_blocked_us;
+
+/* CAN TX governor */
+
+// Every frame has to be paid for from three token buckets: the sensor's own, its message class's, and
+// the total TTPMS budget (settable from the settings frame). If any of them can't pay for a whole sample,
+// the sample stays in its mailbox and is coalesced with newer ones, so TTPMS never exceeds the bus load we allow.
+// Tokens are kept in millitokens (1000 = one frame) so the refill doesn't need floating point.
+
+#define TTPMS_CLASS_TEMP	0
+#define TTPMS_CLASS_STATUS	1
+#define TTPMS_CLASS_PRESSURE	2
+#define TTPMS_NUM_CLASSES	3
+
+struct TTPMS_token_bucket {
+	uint32_t rate;		// frames/s
+	int32_t tokens;		// millitokens
+};
+
+struct TTPMS_token_bucket CAN_tx_sensor_bucket[TTPMS_CAN_TX_SOURCES];
+struct TTPMS_token_bucket CAN_tx_class_bucket[TTPMS_NUM_CLASSES];
+struct TTPMS_token_bucket CAN_tx_total_bucket;
+
+static uint8_t CAN_tx_class(uint8_t source)
+{
+	if (source < TTPMS_NUM_SENSORS) {
+		return TTPMS_CLASS_TEMP;
+	}
+	return (source >= TTPMS_RX_PRESSURE) ? TTPMS_CLASS_PRESSURE : TTPMS_CLASS_STATUS;
 }
 
-void status_CAN_tx_work_handler(struct k_work *work)
+static void CAN_tx_bucket_refill(struct TTPMS_token_bucket *bucket, int64_t elapsed_ms)
 {
-	//LOG_INF("status_CAN_tx_work_handler: Sending TTPMS status frame");
-	TTPMS_CAN_send(&TTPMS_status);
+	// allow a burst of CONFIG_TTPMS_CAN_BUDGET_BURST_MS worth of frames, but always at least one whole sample
+	int32_t max = MAX(bucket->rate * CONFIG_TTPMS_CAN_BUDGET_BURST_MS, TTPMS_CAN_TX_MAX_FRAMES * 1000);
+
+	bucket->tokens = MIN(bucket->tokens + (int32_t)(bucket->rate * elapsed_ms), max);
 }
-K_WORK_DEFINE(status_CAN_tx_work, status_CAN_tx_work_handler);
 
-void IFL_temp_CAN_tx_work_handler(struct k_work *work)
+// ms until the bucket has enough tokens for num_frames (0 if it already does)
+static uint32_t CAN_tx_bucket_wait(const struct TTPMS_token_bucket *bucket, uint8_t num_frames)
 {
-	//LOG_INF("IFL_temp_CAN_tx_work_handler: Sending IFL temp frames");
-	TTPMS_CAN_send(&IFL_temp_1);
-	TTPMS_CAN_send(&IFL_temp_2);
+	int32_t missing = num_frames * 1000 - bucket->tokens;
+
+	if (missing <= 0) {
+		return 0;
+	}
+	if (bucket->rate == 0) {
+		return UINT32_MAX;
+	}
+	return DIV_ROUND_UP(missing, bucket->rate);
 }
-K_WORK_DEFINE(IFL_temp_CAN_tx_work, IFL_temp_CAN_tx_work_handler);
 
-void EFL_temp_CAN_tx_work_handler(struct k_work *work)
+void CAN_tx_governor_init(void)
 {
-	//LOG_INF("EFL_temp_CAN_tx_work_handler: Sending EFL temp frames");
-	TTPMS_CAN_send(&EFL_temp_1);
-	TTPMS_CAN_send(&EFL_temp_2);
-	TTPMS_CAN_send(&EFL_temp_3);
-	TTPMS_CAN_send(&EFL_temp_4);
+	for (int i = 0; i < TTPMS_CAN_TX_SOURCES; i++) {
+		CAN_tx_sensor_bucket[i].rate = (CAN_tx_class(i) == TTPMS_CLASS_STATUS) ? CONFIG_TTPMS_CAN_BUDGET_STATUS : CONFIG_TTPMS_CAN_BUDGET_SENSOR;
+	}
+	CAN_tx_class_bucket[TTPMS_CLASS_TEMP].rate = CONFIG_TTPMS_CAN_BUDGET_TEMP;
+	CAN_tx_class_bucket[TTPMS_CLASS_STATUS].rate = CONFIG_TTPMS_CAN_BUDGET_STATUS;
+	CAN_tx_class_bucket[TTPMS_CLASS_PRESSURE].rate = CONFIG_TTPMS_CAN_BUDGET_PRESSURE;
 }
-K_WORK_DEFINE(EFL_temp_CAN_tx_work, EFL_temp_CAN_tx_work_handler);
 
-void EFR_temp_CAN_tx_work_handler(struct k_work *work)
+// Only called from the CAN TX thread, so the buckets don't need locking
+void CAN_tx_governor_refill(void)
 {
-	//LOG_INF("EFR_temp_CAN_tx_work_handler: Sending EFR temp frames");
-	TTPMS_CAN_send(&EFR_temp_1);
-	TTPMS_CAN_send(&EFR_temp_2);
-	TTPMS_CAN_send(&EFR_temp_3);
-	TTPMS_CAN_send(&EFR_temp_4);
+	static int64_t last_refill;
+	int64_t elapsed_ms = MIN(k_uptime_delta(&last_refill), 1000);	// buckets are full after 1s anyway
+
+	CAN_tx_total_bucket.rate = atomic_get(&CAN_tx_budget_total);
+	CAN_tx_bucket_refill(&CAN_tx_total_bucket, elapsed_ms);
+
+	for (int i = 0; i < TTPMS_NUM_CLASSES; i++) {
+		CAN_tx_bucket_refill(&CAN_tx_class_bucket[i], elapsed_ms);
+	}
+	for (int i = 0; i < TTPMS_CAN_TX_SOURCES; i++) {
+		CAN_tx_bucket_refill(&CAN_tx_sensor_bucket[i], elapsed_ms);
+	}
 }
-K_WORK_DEFINE(EFR_temp_CAN_tx_work, EFR_temp_CAN_tx_work_handler);
 
-void ERL_temp_CAN_tx_work_handler(struct k_work *work)
+#define TTPMS_GOVERNOR_BUCKETS(source)	{							\
+		&CAN_tx_sensor_bucket[source],								\
+		&CAN_tx_class_bucket[CAN_tx_class(source)],					\
+		&CAN_tx_total_bucket,										\
+	}
+
+// Take tokens for a whole sample from all three buckets. If that isn't possible nothing is taken,
+// and *wait_ms is lowered to when this source could be sent.
+static bool CAN_tx_governor_take(uint8_t source, uint8_t num_frames, uint32_t *wait_ms)
 {
-	//LOG_INF("ERL_temp_CAN_tx_work_handler: Sending ERL temp frames");
-	TTPMS_CAN_send(&ERL_temp_1);
-	TTPMS_CAN_send(&ERL_temp_2);
+	struct TTPMS_token_bucket *buckets[] = TTPMS_GOVERNOR_BUCKETS(source);
+	uint32_t wait = 0;
+
+	for (int i = 0; i < ARRAY_SIZE(buckets); i++) {
+		wait = MAX(wait, CAN_tx_bucket_wait(buckets[i], num_frames));
+	}
+
+	if (wait > 0) {
+		*wait_ms = MIN(*wait_ms, wait);
+		return false;
+	}
+
+	for (int i = 0; i < ARRAY_SIZE(buckets); i++) {
+		buckets[i]->tokens -= num_frames * 1000;
+	}
+	return true;
 }
-K_WORK_DEFINE(ERL_temp_CAN_tx_work, ERL_temp_CAN_tx_work_handler);
 
-void ERR_temp_CAN_tx_work_handler(struct k_work *work)
+// Give back the tokens of frames that were charged but never made it onto the bus
+static void CAN_tx_governor_refund(uint8_t source, uint8_t num_frames)
 {
-	//LOG_INF("ERR_temp_CAN_tx_work_handler: Sending ERR temp frames");
-	TTPMS_CAN_send(&ERR_temp_1);
-	TTPMS_CAN_send(&ERR_temp_2);
+	struct TTPMS_token_bucket *buckets[] = TTPMS_GOVERNOR_BUCKETS(source);
+
+	for (int i = 0; i < ARRAY_SIZE(buckets); i++) {
+		buckets[i]->tokens += num_frames * 1000;
+	}
 }
-K_WORK_DEFINE(ERR_temp_CAN_tx_work, ERR_temp_CAN_tx_work_handler);
 
-void TTPMS_CAN_init(void)
+// Move the latest sample of a mailbox into its TX slot, charging the governor for it. Returns false if there is
+// nothing to take, the previous sample of this mailbox is still being sent, or the source is over budget (then the
+// sample stays in the mailbox and *wait_ms is lowered to when it could be sent).
+// The governor is charged under the mailbox lock, so it's charged for the sample actually taken, even if a producer
+// swaps in a sample with a different number of frames right before.
+static bool CAN_tx_take(struct TTPMS_CAN_mailbox *mb, uint32_t *wait_ms)
+{
+	k_spinlock_key_t key;
+
+	if (atomic_get(&mb->tx.in_flight) != 0) {
+		return false;
+	}
+
+	key = k_spin_lock(&mb->lock);
+	if (!atomic_test_bit(CAN_tx_pending, mb->tx.source) ||
+		!CAN_tx_governor_take(mb->tx.source, mb->num_frames, wait_ms)) {
+		k_spin_unlock(&mb->lock, key);
+		return false;
+	}
+	atomic_clear_bit(CAN_tx_pending, mb->tx.source);
+
+	uint32_t waited = k_uptime_get_32() - mb->pending_since;
+
+	if (waited > atomic_get(&CAN_tx_stats[mb->tx.source].wait_max_ms)) {	// only the TX thread writes this
+		atomic_set(&CAN_tx_stats[mb->tx.source].wait_max_ms, waited);
+	}
+	mb->tx.num_frames = mb->num_frames;
+	memcpy(mb->tx.frames, mb->latest, mb->num_frames * sizeof(struct can_frame));
+	k_spin_unlock(&mb->lock, key);
+
+	return true;
+}
+
+static void CAN_tx_pace_release(uint32_t *wait_ms);
+
+void CAN_tx_thread(void *p1, void *p2, void *p3)
 {
+	struct TTPMS_CAN_tx_slot *slot;
+	uint8_t next = 0;	// round robin, so one chatty sensor can't starve the others
+	uint32_t wait_ms = UINT32_MAX;	// how long until the governor lets a held back sample through
+	bool sent_any;
+	uint32_t start;
 	int err;
 
-	if (!device_is_ready(can_dev)) {
-		LOG_WRN("CAN device not ready");
+	for (int i = 0; i < TTPMS_CAN_TX_SOURCES; i++) {
+		CAN_tx_mailbox[i].tx.source = i;
+	}
+
+	CAN_tx_governor_init();
+
+	while (1) {
+
+		k_sem_take(&CAN_tx_wake_sem, (wait_ms == UINT32_MAX) ? K_FOREVER : K_MSEC(wait_ms));
+
+		if (atomic_test_bit(flags, CAN_BUS_OFF_FLAG)) {
+			wait_ms = UINT32_MAX;
+			continue;	// hold the mailboxes until bus-off recovery wakes us up again
+		}
+
+		do {
+			sent_any = false;
+			wait_ms = UINT32_MAX;
+			CAN_tx_pace_release(&wait_ms);
+			CAN_tx_governor_refill();
+
+			for (int n = 0; n < TTPMS_CAN_TX_SOURCES; n++) {
+
+				uint8_t source = (next + n) % TTPMS_CAN_TX_SOURCES;
+				struct TTPMS_CAN_mailbox *mb = &CAN_tx_mailbox[source];
+
+				if (!atomic_test_bit(CAN_tx_pending, source) || atomic_get(&mb->tx.in_flight) != 0) {
+					continue;
+				}
+				if (!CAN_tx_take(mb, &wait_ms)) {
+					continue;	// nothing new, or over budget and left in the mailbox for now
+				}
+				slot = &mb->tx;
+				sent_any = true;
+				next = source + 1;
+
+				// hold one reference ourselves so the TX callbacks can't release the slot while we are still queuing frames
+				atomic_set(&slot->in_flight, 1);
+
+				for (int i = 0; i < slot->num_frames; i++) {
+
+					start = k_cycle_get_32();
+					err = TTPMS_CAN_send(slot, i);
+					atomic_add(&CAN_tx_blocked_us, k_cyc_to_us_floor32(k_cycle_get_32() - start));
+
+					if (err != 0) {
+						// don't send a torn sample, drop the rest of it
+						atomic_add((err == -EAGAIN) ? &CAN_tx_stats[source].abandoned : &CAN_tx_stats[source].errors,
+							   slot->num_frames - i);
+						CAN_tx_governor_refund(source, slot->num_frames - i);
+						break;
+					}
+				}
+
+				// drop our reference, once the callbacks drop theirs the slot is free again
+				atomic_dec(&slot->in_flight);
+				break;
+			}
+		} while (sent_any);
+	}
+}
+
+K_THREAD_DEFINE(CAN_tx_thread_id, CONFIG_TTPMS_CAN_TX_THREAD_STACK_SIZE, CAN_tx_thread, NULL, NULL, NULL,
+		CONFIG_TTPMS_CAN_TX_THREAD_PRIORITY, 0, 0);
+
+// Copy one sample into the source's mailbox, replacing any unsent sample. The data is split into frames of
+// up to 8 bytes with consecutive IDs starting at first_id. Safe to call from any thread (does not block).
+void TTPMS_CAN_queue_sample(uint8_t source, uint32_t first_id, const uint8_t *data, uint8_t length)
+{
+	struct TTPMS_CAN_mailbox *mb = &CAN_tx_mailbox[source];
+	uint8_t num_frames = DIV_ROUND_UP(length, CAN_MAX_DLEN);
+	k_spinlock_key_t key;
+
+	__ASSERT_NO_MSG(num_frames <= TTPMS_CAN_TX_MAX_FRAMES);
+
+	if (IS_ENABLED(CONFIG_TTPMS_CAN_BUS_OFF_FLUSH) && atomic_test_bit(flags, CAN_BUS_OFF_FLAG)) {
+		atomic_add(&CAN_tx_stats[source].abandoned, num_frames);
 		return;
 	}
 
-	err = can_start(can_dev);
-	if (err != 0) {
-		LOG_WRN("Error starting CAN controller (err %d)", err);
+	key = k_spin_lock(&mb->lock);
+
+	if (atomic_test_and_set_bit(CAN_tx_pending, source)) {
+		atomic_inc(&CAN_tx_stats[source].coalesced);
+	} else {
+		mb->pending_since = k_uptime_get_32();
+	}
+
+	mb->num_frames = num_frames;
+	for (int i = 0; i < num_frames; i++) {
+		mb->latest[i].flags = 0;
+		mb->latest[i].id = first_id + i;
+		mb->latest[i].dlc = MIN(length, CAN_MAX_DLEN);
+		memcpy(mb->latest[i].data, data, mb->latest[i].dlc);
+		data += mb->latest[i].dlc;
+		length -= mb->latest[i].dlc;
+	}
+
+	k_spin_unlock(&mb->lock, key);
+
+	atomic_add(&CAN_tx_stats[source].queued, num_frames);
+	k_sem_give(&CAN_tx_wake_sem);
+}
+
+// Samples that arrived together in a batched notification are released to their mailbox at their original spacing,
+// so the dash sees a steady sample rate instead of bursts. Each source has a small ring of samples waiting for their
+// release time, which the CAN TX thread drains. If a ring is full the oldest sample is dropped (counted as coalesced,
+// it would have been replaced in the mailbox anyway).
+
+struct TTPMS_paced_sample {
+	uint32_t release;		// k_uptime_get_32() time to hand it to the mailbox
+	uint32_t first_id;
+	uint8_t length;
+	uint8_t data[TTPMS_CAN_TX_MAX_FRAMES * CAN_MAX_DLEN];
+};
+
+struct TTPMS_pace_ring {
+	struct k_spinlock lock;
+	uint8_t head;			// oldest
+	uint8_t count;
+	uint32_t last_release;
+	struct TTPMS_paced_sample samples[CONFIG_TTPMS_BATCH_MAX];
+};
+
+struct TTPMS_pace_ring CAN_tx_pace[TTPMS_CAN_TX_SOURCES];
+
+// Like TTPMS_CAN_queue_sample, but the sample is only queued at release (k_uptime_get_32() time).
+// Samples of one source are released in order, never before an earlier one.
+void TTPMS_CAN_queue_sample_at(uint8_t source, uint32_t first_id, const uint8_t *data, uint8_t length, uint32_t release)
+{
+	struct TTPMS_pace_ring *ring = &CAN_tx_pace[source];
+	struct TTPMS_paced_sample *sample;
+	k_spinlock_key_t key;
+
+	__ASSERT_NO_MSG(length <= sizeof(sample->data));
+
+	key = k_spin_lock(&ring->lock);
+
+	if (ring->count == 0 && (int32_t)(release - k_uptime_get_32()) <= 0) {
+		k_spin_unlock(&ring->lock, key);
+		TTPMS_CAN_queue_sample(source, first_id, data, length);	// due now, nothing ahead of it
 		return;
 	}
 
-	err = can_add_rx_filter(can_dev, settings_frame_cb, NULL, &settings_frame_filter);
-	if (err < 0) {
-		LOG_ERR("Unable to add CAN RX filter (err %d)", err);
+	if (ring->count == ARRAY_SIZE(ring->samples)) {
+		ring->head = (ring->head + 1) % ARRAY_SIZE(ring->samples);
+		ring->count--;
+		atomic_inc(&CAN_tx_stats[source].coalesced);
+	}
+
+	if (ring->count && (int32_t)(release - ring->last_release) < 0) {
+		release = ring->last_release;
 	}
+	ring->last_release = release;
+
+	sample = &ring->samples[(ring->head + ring->count) % ARRAY_SIZE(ring->samples)];
+	sample->release = release;
+	sample->first_id = first_id;
+	sample->length = length;
+	memcpy(sample->data, data, length);
+	ring->count++;
+
+	k_spin_unlock(&ring->lock, key);
+
+	k_sem_give(&CAN_tx_wake_sem);	// so the TX thread picks up the new release time
 }
 
-/* --- CAN BUS END --- */
+// Hand paced samples that are due to their mailboxes, and lower *wait_ms to when the next one is due.
+// Only called from the CAN TX thread.
+static void CAN_tx_pace_release(uint32_t *wait_ms)
+{
+	for (int i = 0; i < TTPMS_CAN_TX_SOURCES; i++) {
+		struct TTPMS_pace_ring *ring = &CAN_tx_pace[i];
+		struct TTPMS_paced_sample sample;
+		k_spinlock_key_t key;
+		int32_t due;
+
+		while (1) {
+			key = k_spin_lock(&ring->lock);
+			if (ring->count == 0) {
+				k_spin_unlock(&ring->lock, key);
+				break;
+			}
 
+			due = ring->samples[ring->head].release - k_uptime_get_32();
+			if (due > 0) {
+				k_spin_unlock(&ring->lock, key);
+				*wait_ms = MIN(*wait_ms, due);
+				break;
+			}
 
+			sample = ring->samples[ring->head];
+			ring->head = (ring->head + 1) % ARRAY_SIZE(ring->samples);
+			ring->count--;
+			k_spin_unlock(&ring->lock, key);
 
-/* --- BLE STUFF START --- */
+			TTPMS_CAN_queue_sample(i, sample.first_id, sample.data, sample.length);
+		}
+	}
+}
 
-#define CONN_INTERVAL	24	// * 1.25 = 30 ms	try changing back to 10ms for the lols?
-#define CONN_LATENCY	0
-#define CONN_TIMEOUT	MIN(MAX((CONN_INTERVAL * 125 * \
-			       		MAX(CONFIG_BT_MAX_CONN, 6) / 1000), 10), 3200)
+const char *TTPMS_sensor_name(uint8_t index);
 
-//#define SCAN_INTERVAL	400	// * 0.625 = 250 ms
-//#define SCAN_WINDOW		64	// * 0.625 = 40 ms
+void TTPMS_CAN_log_stats(void)
+{
+	static atomic_val_t last_failed;
+	atomic_val_t failed = atomic_get(&CAN_tx_failed);
+	size_t unused = 0;
+
+	if (failed != last_failed) {
+		LOG_WRN("CAN TX failed for %ld frames since the last stats (last err %ld)", failed - last_failed,
+			atomic_get(&CAN_tx_last_error));
+		last_failed = failed;
+	}
 
-struct bt_le_conn_param conn_param = {
-		.interval_min = CONN_INTERVAL,
-		.interval_max = CONN_INTERVAL,
-		.latency = CONN_LATENCY,
-		.timeout = CONN_TIMEOUT,
-	};
+	k_thread_stack_space_get(CAN_tx_thread_id, &unused);
+	LOG_INF("CAN TX thread: stack used %zu/%d bytes, blocked waiting for TX buffers for %ld ms",
+		CONFIG_TTPMS_CAN_TX_THREAD_STACK_SIZE - unused, CONFIG_TTPMS_CAN_TX_THREAD_STACK_SIZE,
+		atomic_get(&CAN_tx_blocked_us) / 1000);
+
+	for (int i = 0; i < TTPMS_CAN_TX_SOURCES; i++) {
+		if (atomic_get(&CAN_tx_stats[i].queued)) {
+			LOG_INF("CAN TX %s%s: queued %ld, sent %ld, abandoned %ld, errors %ld, coalesced %ld",
+				(i == TTPMS_RX_SELF) ? "status" : (i == TTPMS_RX_DIAG) ? "diag" : TTPMS_sensor_name((i >= TTPMS_RX_PRESSURE) ? i - TTPMS_RX_PRESSURE : i),
+				(i >= TTPMS_RX_PRESSURE) ? " pressure" : "",
+				atomic_get(&CAN_tx_stats[i].queued), atomic_get(&CAN_tx_stats[i].sent),
+				atomic_get(&CAN_tx_stats[i].abandoned), atomic_get(&CAN_tx_stats[i].errors),
+				atomic_get(&CAN_tx_stats[i].coalesced));
+		}
+	}
+}
 
-struct bt_conn_le_create_param scan_param = {
-		.options = BT_CONN_LE_OPT_NONE,
-		//.interval = SCAN_INTERVAL,
-		//.window = SCAN_WINDOW,
-	};
+// Bus load caused by TTPMS since the last call, with 0.1% scale (for the status frame)
+uint16_t TTPMS_CAN_bus_load(void)
+{
+	static int64_t last_time;
+	int64_t elapsed_ms = k_uptime_delta(&last_time);
+	uint64_t bits = atomic_clear(&CAN_tx_bits);
 
-static bt_addr_le_t IFL_bt_addr;
-static bt_addr_le_t IFR_bt_addr;
-static bt_addr_le_t IRL_bt_addr;
-static bt_addr_le_t IRR_bt_addr;
-static bt_addr_le_t EFL_bt_addr;
-static bt_addr_le_t EFR_bt_addr;
-static bt_addr_le_t ERL_bt_addr;
-static bt_addr_le_t ERR_bt_addr;
+	if (elapsed_ms <= 0) {
+		return 0;
+	}
+	return MIN(bits * 1000 * 1000 / ((uint64_t)CAN_BITRATE * elapsed_ms), UINT16_MAX);
+}
 
-int bt_identity;	// self BT address/identity
+/* CAN RX / hardware filters */
 
-// here we set the connected bit for the sensor that connected (self-explanatory)
-static void connected(struct bt_conn *conn, uint8_t err)
+// The Zephyr MCP2515 driver sets the RX buffers to receive everything and filters in software, so every frame on
+// the bus costs an interrupt and SPI reads. We keep track of the filters we register, and program the MCP2515's own
+// RXM/RXF mask and filter registers so it only accepts those IDs.
+// NOTE: the driver rewrites RXB0CTRL/RXB1CTRL in can_set_timing, so the filters must be programmed again after that.
+
+#define TTPMS_CAN_MAX_RX_FILTERS	6	// MCP2515 has 6 acceptance filters
+
+#define MCP2515_OPCODE_WRITE	0x02
+#define MCP2515_ADDR_RXB0CTRL	0x60
+#define MCP2515_ADDR_RXB1CTRL	0x70
+#define MCP2515_ADDR_RXM0SIDH	0x20
+#define MCP2515_ADDR_RXM1SIDH	0x24
+#define MCP2515_RXBCTRL_BUKT	BIT(2)	// RXB0 rolls over into RXB1 (RXM bits = 00 means filters are used)
+
+static const uint8_t mcp2515_rxf_addr[] = {0x00, 0x04, 0x08, 0x10, 0x14, 0x18};	// RXF0SIDH .... RXF5SIDH
+
+struct TTPMS_CAN_rx_filter {
+	can_rx_callback_t callback;
+	void *user_data;
+	struct can_filter filter;
+};
+
+struct TTPMS_CAN_rx_filter CAN_rx_filters[TTPMS_CAN_MAX_RX_FILTERS];
+uint8_t CAN_rx_num_filters;
+
+atomic_t CAN_int_count;			// MCP2515 interrupts
+atomic_t CAN_rx_accepted;		// frames passed to one of our callbacks
+bool CAN_hw_filters_enabled;
+
+static struct gpio_callback mcp2515_int_cb_data;
+
+static void mcp2515_int_cb(const struct device *port, struct gpio_callback *cb, gpio_port_pins_t pins)
 {
-	char addr_str[BT_ADDR_LE_STR_LEN];
+	atomic_inc(&CAN_int_count);
+}
 
-	const bt_addr_le_t *addr = bt_conn_get_dst(conn);
+static void CAN_rx_cb(const struct device *dev, struct can_frame *frame, void *user_data)
+{
+	struct TTPMS_CAN_rx_filter *rx_filter = user_data;
 
-	bt_addr_le_to_str(addr, addr_str, sizeof(addr_str));
+	atomic_inc(&CAN_rx_accepted);
+	rx_filter->callback(dev, frame, rx_filter->user_data);
+}
 
-	if (err) {
-		LOG_WRN("Failed to connect to %s (%u)", addr_str, err);
-	} else {
+// can_add_rx_filter, but the filter is also remembered so it can be programmed into the MCP2515
+int TTPMS_CAN_add_rx_filter(can_rx_callback_t callback, void *user_data, const struct can_filter *filter)
+{
+	struct TTPMS_CAN_rx_filter *rx_filter;
 
-		if (bt_addr_le_eq(addr, &IFL_bt_addr)) {
+	if (CAN_rx_num_filters >= TTPMS_CAN_MAX_RX_FILTERS) {
+		return -ENOSPC;
+	}
 
-			if(atomic_test_and_set_bit(flags, IFL_CONNECTED_FLAG)) {
-				LOG_WRN("WARNING, DUPLICATE CONNECTION:");
-			}
-			LOG_INF("Internal FL connected, addr: %s", addr_str);
+	rx_filter = &CAN_rx_filters[CAN_rx_num_filters];
+	rx_filter->callback = callback;
+	rx_filter->user_data = user_data;
+	rx_filter->filter = *filter;
 
-		} else if (bt_addr_le_eq(addr, &IFR_bt_addr)) {
+	int err = can_add_rx_filter(can_dev, CAN_rx_cb, rx_filter, filter);
+	if (err >= 0) {
+		CAN_rx_num_filters++;
+	}
+	return err;
+}
 
-			if(atomic_test_and_set_bit(flags, IFR_CONNECTED_FLAG)) {
-				LOG_WRN("WARNING, DUPLICATE CONNECTION:");
-			}
-			LOG_INF("Internal FR connected, addr: %s", addr_str);
+// Writes a standard ID to a 4 byte MCP2515 filter/mask register group (SIDH, SIDL, EID8, EID0)
+static int mcp2515_write_std_id(uint8_t addr, uint16_t id)
+{
+	uint8_t buf[] = {MCP2515_OPCODE_WRITE, addr, id >> 3, (id & 0x07) << 5, 0, 0};
+	const struct spi_buf tx_buf = {.buf = buf, .len = sizeof(buf)};
+	const struct spi_buf_set tx = {.buffers = &tx_buf, .count = 1};
 
-		} else if (bt_addr_le_eq(addr, &IRL_bt_addr)) {
+	return spi_write_dt(&mcp2515_spi, &tx);
+}
 
-			if(atomic_test_and_set_bit(flags, IRL_CONNECTED_FLAG)) {
-				LOG_WRN("WARNING, DUPLICATE CONNECTION:");
-			}
-			LOG_INF("Internal RL connected, addr: %s", addr_str);
-			
-		} else if (bt_addr_le_eq(addr, &IRR_bt_addr)) {
+static int mcp2515_write_reg(uint8_t addr, uint8_t value)
+{
+	uint8_t buf[] = {MCP2515_OPCODE_WRITE, addr, value};
+	const struct spi_buf tx_buf = {.buf = buf, .len = sizeof(buf)};
+	const struct spi_buf_set tx = {.buffers = &tx_buf, .count = 1};
+
+	return spi_write_dt(&mcp2515_spi, &tx);
+}
+
+// Program the MCP2515 acceptance masks/filters from the registered filters. Must be called while CAN is stopped
+// (configuration mode). Both masks get the bits every filter cares about, so each filter still sees all of its frames.
+static int TTPMS_CAN_program_hw_filters(void)
+{
+	uint16_t mask = CAN_STD_ID_MASK;
+	uint16_t ids[ARRAY_SIZE(mcp2515_rxf_addr)];
+	int err = 0;
+
+	if (CAN_rx_num_filters == 0 || !spi_is_ready_dt(&mcp2515_spi)) {
+		return -ENODEV;
+	}
+
+	for (int i = 0; i < CAN_rx_num_filters; i++) {
+		if (CAN_rx_filters[i].filter.flags & CAN_FILTER_IDE) {
+			return -ENOTSUP;	// extended IDs are not used by TTPMS, keep receiving everything
+		}
+		mask &= CAN_rx_filters[i].filter.mask;
+	}
+
+	for (int i = 0; i < ARRAY_SIZE(ids); i++) {
+		// unused filter registers repeat the first filter, so they don't open up anything extra
+		ids[i] = CAN_rx_filters[(i < CAN_rx_num_filters) ? i : 0].filter.id & CAN_STD_ID_MASK;
+	}
+
+	err |= mcp2515_write_std_id(MCP2515_ADDR_RXM0SIDH, mask);
+	err |= mcp2515_write_std_id(MCP2515_ADDR_RXM1SIDH, mask);
+	for (int i = 0; i < ARRAY_SIZE(ids); i++) {
+		err |= mcp2515_write_std_id(mcp2515_rxf_addr[i], ids[i]);
+	}
+	err |= mcp2515_write_reg(MCP2515_ADDR_RXB0CTRL, MCP2515_RXBCTRL_BUKT);
+	err |= mcp2515_write_reg(MCP2515_ADDR_RXB1CTRL, 0);
+
+	return err ? -EIO : 0;
+}
+
+/* CAN bus state / bus-off recovery */
+
+// The MCP2515 reports error state changes through the driver's state change callback. When the controller goes
+// bus-off, TX is held (the TX thread stops taking samples from the mailboxes) and the recovery work checks the
+// state again after a back-off. If the controller is still bus-off, it is restarted (can_stop/can_start) and the
+// back-off doubles, up to CONFIG_TTPMS_CAN_RECOVERY_MAX_MS, so TX resumes within a bounded time after a glitch.
+// While bus-off the mailboxes keep only the latest sample of each source, or with CONFIG_TTPMS_CAN_BUS_OFF_FLUSH
+// everything pending (and anything new) is discarded and counted as abandoned.
+
+atomic_t CAN_state = ATOMIC_INIT(CAN_STATE_ERROR_ACTIVE);
+atomic_t CAN_state_transitions;
+atomic_t CAN_bus_off_count;
+atomic_t CAN_restart_count;
+uint32_t CAN_recovery_backoff_ms = CONFIG_TTPMS_CAN_RECOVERY_MIN_MS;	// only touched on the system workqueue
+
+static void CAN_bus_up(void)
+{
+	if (atomic_test_and_clear_bit(flags, CAN_BUS_OFF_FLAG)) {
+		LOG_INF("CAN bus recovered");
+		k_sem_give(&CAN_tx_wake_sem);
+	}
+}
+
+void CAN_recovery_work_handler(struct k_work *work)
+{
+	struct k_work_delayable *dwork = k_work_delayable_from_work(work);
+	struct can_bus_err_cnt err_cnt;
+	enum can_state state;
+	int err;
+
+	err = can_get_state(can_dev, &state, &err_cnt);
+	if (err == 0 && state != CAN_STATE_BUS_OFF && state != CAN_STATE_STOPPED) {
+		atomic_set(&CAN_state, state);
+		CAN_recovery_backoff_ms = CONFIG_TTPMS_CAN_RECOVERY_MIN_MS;
+		CAN_bus_up();
+		return;
+	}
+
+	// still bus-off, restart the controller (aborts whatever is left in the TX buffers)
+	LOG_WRN("CAN still bus-off, restarting controller (back-off %u ms)", CAN_recovery_backoff_ms);
+	can_stop(can_dev);
+	err = can_start(can_dev);
+	if (err) {
+		LOG_ERR("Error restarting CAN controller (err %d)", err);
+	}
+	atomic_inc(&CAN_restart_count);
+
+	CAN_recovery_backoff_ms = MIN(CAN_recovery_backoff_ms * 2, CONFIG_TTPMS_CAN_RECOVERY_MAX_MS);
+	k_work_reschedule(dwork, K_MSEC(CAN_recovery_backoff_ms));
+}
+K_WORK_DELAYABLE_DEFINE(CAN_recovery_work, CAN_recovery_work_handler);
+
+// Called by the CAN driver (from its interrupt thread)
+void CAN_state_change_cb(const struct device *dev, enum can_state state, struct can_bus_err_cnt err_cnt, void *user_data)
+{
+	if (atomic_set(&CAN_state, state) == state) {
+		return;
+	}
+	atomic_inc(&CAN_state_transitions);
+	LOG_INF("CAN state changed to %d (TEC %u, REC %u)", state, err_cnt.tx_err_cnt, err_cnt.rx_err_cnt);
+
+	if (state == CAN_STATE_BUS_OFF) {
+
+		if (!atomic_test_and_set_bit(flags, CAN_BUS_OFF_FLAG)) {
+			atomic_inc(&CAN_bus_off_count);
+
+			if (IS_ENABLED(CONFIG_TTPMS_CAN_BUS_OFF_FLUSH)) {
+				for (int i = 0; i < TTPMS_CAN_TX_SOURCES; i++) {
+					struct TTPMS_CAN_mailbox *mb = &CAN_tx_mailbox[i];
+					k_spinlock_key_t key = k_spin_lock(&mb->lock);
+
+					// pending bit and num_frames together, like every other mailbox access
+					if (atomic_test_and_clear_bit(CAN_tx_pending, i)) {
+						atomic_add(&CAN_tx_stats[i].abandoned, mb->num_frames);
+					}
+					k_spin_unlock(&mb->lock, key);
+				}
+			}
+		}
+		k_work_schedule(&CAN_recovery_work, K_MSEC(CONFIG_TTPMS_CAN_RECOVERY_MIN_MS));
+
+	} else if (state != CAN_STATE_STOPPED) {
+		k_work_cancel_delayable(&CAN_recovery_work);
+		CAN_bus_up();
+	}
+}
+
+// Diagnostics rows are numbered by position (see TTPMS_DIAG_FRAME_ID), not by sensor index
+#define TTPMS_DIAG_ROW_TEMP			0	// one per position
+#define TTPMS_DIAG_ROW_SELF			(TTPMS_DIAG_ROW_TEMP + TTPMS_NUM_POSITIONS)
+#define TTPMS_DIAG_ROW_DIAG			(TTPMS_DIAG_ROW_SELF + 1)
+#define TTPMS_DIAG_ROW_PRESSURE		(TTPMS_DIAG_ROW_DIAG + 1)	// one per internal position
+#define TTPMS_DIAG_ROW_CAN_RX		(TTPMS_DIAG_ROW_PRESSURE + TTPMS_NUM_PRESSURE_POSITIONS)
+#define TTPMS_DIAG_ROW_CAN_STATE	(TTPMS_DIAG_ROW_CAN_RX + 1)
+#define TTPMS_DIAG_ROW_LINK			(TTPMS_DIAG_ROW_CAN_STATE + 1)	// one per position
+#define TTPMS_DIAG_ROW_RADIO		(TTPMS_DIAG_ROW_LINK + TTPMS_NUM_POSITIONS)	// one per position
+#define TTPMS_DIAG_ROW_DELIVERY		(TTPMS_DIAG_ROW_RADIO + TTPMS_NUM_POSITIONS)	// one per position
+#define TTPMS_DIAG_ROW_CHAN			(TTPMS_DIAG_ROW_DELIVERY + TTPMS_NUM_POSITIONS)	// map, then quality
+#define TTPMS_DIAG_ROW_STATE		(TTPMS_DIAG_ROW_CHAN + 7)	// two per position
+#define TTPMS_DIAG_ROWS				(TTPMS_DIAG_ROW_STATE + 2 * TTPMS_NUM_POSITIONS)
+
+// Sensor index of a per-position row in the group starting at base, and which of the group's tables (0, 1 ....) it is in
+static uint8_t TTPMS_diag_row_sensor(uint8_t row, uint8_t base, uint8_t *table)
+{
+	*table = (row - base) / TTPMS_NUM_POSITIONS;
+	return position_sensor[(row - base) % TTPMS_NUM_POSITIONS];
+}
+
+void TTPMS_BLE_diag_row(uint8_t index, uint8_t *data);
+void TTPMS_chan_diag_row(uint8_t index, uint8_t *data);
+void TTPMS_link_diag_row(uint8_t index, uint8_t *data);
+
+// Fill in one row of the diagnostics frame, false if the row belongs to a position that isn't fitted
+static bool TTPMS_CAN_diag_row(uint8_t row, uint8_t *data)
+{
+	uint8_t sensor;
+	uint8_t table;
+
+	data[0] = row;
+
+	if (row < TTPMS_DIAG_ROW_CAN_RX) {
+		uint8_t source;
+
+		if (row == TTPMS_DIAG_ROW_SELF) {
+			source = TTPMS_RX_SELF;
+		} else if (row == TTPMS_DIAG_ROW_DIAG) {
+			source = TTPMS_RX_DIAG;
+		} else if (row >= TTPMS_DIAG_ROW_PRESSURE) {
+			sensor = TTPMS_diag_row_sensor(row, TTPMS_DIAG_ROW_PRESSURE, &table);
+			source = (sensor == TTPMS_NOT_FITTED) ? TTPMS_NOT_FITTED : TTPMS_PRESSURE_SOURCE(sensor);
+		} else {
+			source = TTPMS_diag_row_sensor(row, TTPMS_DIAG_ROW_TEMP, &table);
+		}
+
+		if (source == TTPMS_NOT_FITTED) {
+			return false;
+		}
+
+		struct TTPMS_CAN_tx_stats *stats = &CAN_tx_stats[source];
+
+		sys_put_le16(atomic_get(&stats->sent), &data[1]);
+		data[3] = atomic_get(&stats->abandoned);
+		data[4] = atomic_get(&stats->errors);
+		sys_put_le16(atomic_get(&stats->coalesced), &data[5]);
+		data[7] = (MIN(atomic_get(&stats->wait_max_ms) / 10, 0x3F) << 2) | MIN(atomic_get(&stats->in_flight_hwm), 0x3);
+
+	} else if (row == TTPMS_DIAG_ROW_CAN_RX) {
+		atomic_val_t ints = atomic_get(&CAN_int_count);
+		atomic_val_t accepted = atomic_get(&CAN_rx_accepted);
+		atomic_val_t tx_done = 0;
+
+		for (int i = 0; i < TTPMS_CAN_TX_SOURCES; i++) {
+			tx_done += atomic_get(&CAN_tx_stats[i].sent) + atomic_get(&CAN_tx_stats[i].errors);
+		}
+
+		sys_put_le16(ints, &data[1]);
+		sys_put_le16(accepted, &data[3]);
+		sys_put_le16(MAX(ints - tx_done - accepted, 0), &data[5]);
+		data[7] = CAN_hw_filters_enabled;
+
+	} else if (row == TTPMS_DIAG_ROW_CAN_STATE) {
+		struct can_bus_err_cnt err_cnt = {0};
+		enum can_state state;
+
+		if (can_get_state(can_dev, &state, &err_cnt) != 0) {
+			state = atomic_get(&CAN_state);
+		}
+
+		data[1] = state;
+		data[2] = err_cnt.tx_err_cnt;
+		data[3] = err_cnt.rx_err_cnt;
+		sys_put_le16(atomic_get(&CAN_state_transitions), &data[4]);
+		data[6] = atomic_get(&CAN_bus_off_count);
+		data[7] = atomic_get(&CAN_restart_count);
+
+	} else if (row >= TTPMS_DIAG_ROW_STATE) {
+		sensor = TTPMS_diag_row_sensor(row, TTPMS_DIAG_ROW_STATE, &table);
+		if (sensor == TTPMS_NOT_FITTED) {
+			return false;
+		}
+		TTPMS_link_diag_row(table * TTPMS_NUM_SENSORS + sensor, data);
+
+	} else if (row >= TTPMS_DIAG_ROW_CHAN) {
+		TTPMS_chan_diag_row(row - TTPMS_DIAG_ROW_CHAN, data);
+
+	} else {
+		sensor = TTPMS_diag_row_sensor(row, TTPMS_DIAG_ROW_LINK, &table);
+		if (sensor == TTPMS_NOT_FITTED) {
+			return false;
+		}
+		TTPMS_BLE_diag_row(table * TTPMS_NUM_SENSORS + sensor, data);
+	}
+
+	return true;
+}
+
+// Queue the next row of the diagnostics frame, each call moves on to the next row
+void TTPMS_CAN_send_diag(void)
+{
+	static uint8_t row;
+	uint8_t data[TTPMS_DIAG_LEN];
+
+	// ends, the CAN RX and state rows are always there
+	while (!TTPMS_CAN_diag_row(row, data)) {
+		row = (row + 1) % TTPMS_DIAG_ROWS;
+	}
+
+	TTPMS_CAN_queue_sample(TTPMS_RX_DIAG, TTPMS_DIAG_FRAME_ID, data, sizeof(data));
+
+	row = (row + 1) % TTPMS_DIAG_ROWS;
+}
+
+/* CAN TX microbenchmark (CONFIG_TTPMS_CAN_BENCH) */
+
+// The Zephyr MCP2515 driver already uses the LOAD TX BUFFER / RTS and READ RX BUFFER instructions, and the
+// nRF SPIM driver already transfers over EasyDMA, so per-frame cost comes down to the SPI clock.
+#define TTPMS_CAN_BENCH_FRAMES		1000
+#define TTPMS_CAN_BENCH_TIMEOUT_MS	500		// a frame not done by then means loopback isn't working, give up
+
+K_SEM_DEFINE(CAN_bench_sem, TTPMS_CAN_TX_IN_FLIGHT, TTPMS_CAN_TX_IN_FLIGHT);
+static atomic_t CAN_bench_errors;
+
+static void CAN_bench_tx_cb(const struct device *dev, int error, void *user_data)
+{
+	if (error != 0) {
+		atomic_inc(&CAN_bench_errors);
+	}
+	k_sem_give(&CAN_bench_sem);
+}
+
+// Sends TTPMS_CAN_BENCH_FRAMES frames one at a time, then pipelined through all TX buffers. Any failed or stuck
+// frame aborts the run, so a broken loopback can't hang boot or give a bogus result.
+static int TTPMS_CAN_bench_run(const struct can_frame *frame, uint32_t *blocking_cyc, uint32_t *pipelined_cyc)
+{
+	uint32_t start;
+	int err;
+
+	start = k_cycle_get_32();
+	for (int i = 0; i < TTPMS_CAN_BENCH_FRAMES; i++) {
+		err = can_send(can_dev, frame, K_MSEC(TTPMS_CAN_BENCH_TIMEOUT_MS), NULL, NULL);
+		if (err != 0) {
+			LOG_ERR("CAN bench: blocking send %d failed (err %d), aborted", i, err);
+			return err;
+		}
+	}
+	*blocking_cyc = k_cycle_get_32() - start;
+
+	start = k_cycle_get_32();
+	for (int i = 0; i < TTPMS_CAN_BENCH_FRAMES + TTPMS_CAN_TX_IN_FLIGHT; i++) {
+		// the last TTPMS_CAN_TX_IN_FLIGHT takes only wait for the last frames to finish
+		err = k_sem_take(&CAN_bench_sem, K_MSEC(TTPMS_CAN_BENCH_TIMEOUT_MS));
+		if (err != 0) {
+			LOG_ERR("CAN bench: no TX done callback within %d ms, aborted", TTPMS_CAN_BENCH_TIMEOUT_MS);
+			return err;
+		}
+		if (i >= TTPMS_CAN_BENCH_FRAMES) {
+			continue;
+		}
+
+		err = can_send(can_dev, frame, K_MSEC(TTPMS_CAN_BENCH_TIMEOUT_MS), CAN_bench_tx_cb, NULL);
+		if (err != 0) {
+			k_sem_give(&CAN_bench_sem);	// no callback will come for this one
+			LOG_ERR("CAN bench: pipelined send %d failed (err %d), aborted", i, err);
+			return err;
+		}
+	}
+	*pipelined_cyc = k_cycle_get_32() - start;
+
+	if (atomic_get(&CAN_bench_errors) != 0) {
+		LOG_ERR("CAN bench: %d pipelined frames failed in the TX callback, no result", (int)atomic_get(&CAN_bench_errors));
+		return -EIO;
+	}
+
+	return 0;
+}
+
+// Runs the bench in loopback mode and logs the time per frame. Build with different spi-max-frequency values to compare.
+static void TTPMS_CAN_bench(void)
+{
+	struct can_frame frame = {.flags = 0, .id = TTPMS_CAN_BASE_ID + 0x7F, .dlc = CAN_MAX_DLEN};
+	uint32_t blocking_cyc, pipelined_cyc;
+	int err;
+
+	err = can_set_mode(can_dev, CAN_MODE_LOOPBACK);
+	if (err == 0) {
+		err = can_start(can_dev);
+	}
+	if (err != 0) {
+		LOG_WRN("CAN bench: could not start loopback mode (err %d)", err);
+		return;
+	}
+
+	if (TTPMS_CAN_bench_run(&frame, &blocking_cyc, &pipelined_cyc) == 0) {
+		LOG_INF("CAN bench: SPI %u Hz, blocking %u us/frame, pipelined %u us/frame",
+			DT_PROP(DT_CHOSEN(zephyr_canbus), spi_max_frequency),
+			k_cyc_to_us_floor32(blocking_cyc) / TTPMS_CAN_BENCH_FRAMES,
+			k_cyc_to_us_floor32(pipelined_cyc) / TTPMS_CAN_BENCH_FRAMES);
+	}
+
+	can_stop(can_dev);	// also aborts anything still pending after a failed run
+	can_set_mode(can_dev, CAN_MODE_NORMAL);
+}
+
+void TTPMS_CAN_init(void)
+{
+	int err;
+
+	if (!device_is_ready(can_dev)) {
+		LOG_WRN("CAN device not ready");
+		return;
+	}
+
+	if (IS_ENABLED(CONFIG_TTPMS_CAN_BENCH)) {
+		TTPMS_CAN_bench();
+	}
+
+	err = TTPMS_CAN_add_rx_filter(settings_frame_cb, NULL, &settings_frame_filter);
+	if (err < 0) {
+		LOG_ERR("Unable to add CAN RX filter (err %d)", err);
+	}
+
+	err = TTPMS_CAN_add_rx_filter(provision_frame_cb, NULL, &provision_frame_filter);
+	if (err < 0) {
+		LOG_ERR("Unable to add CAN RX filter (err %d)", err);
+	}
+
+	// filters can only be written in configuration mode, which is where the controller is until can_start
+	err = TTPMS_CAN_program_hw_filters();
+	if (err) {
+		LOG_WRN("Unable to program MCP2515 acceptance filters, receiving all frames (err %d)", err);
+	} else {
+		CAN_hw_filters_enabled = true;
+	}
+
+	can_set_state_change_callback(can_dev, CAN_state_change_cb, NULL);
+
+	gpio_init_callback(&mcp2515_int_cb_data, mcp2515_int_cb, BIT(mcp2515_int.pin));
+	err = gpio_add_callback(mcp2515_int.port, &mcp2515_int_cb_data);
+	if (err) {
+		LOG_WRN("Unable to count MCP2515 interrupts (err %d)", err);
+	}
+
+	err = can_start(can_dev);
+	if (err != 0) {
+		LOG_WRN("Error starting CAN controller (err %d)", err);
+		return;
+	}
+}
+
+/* --- CAN BUS END --- */
+
+
+
+/* --- BLE STUFF START --- */
+
+#define CONN_INTERVAL	24	// * 1.25 = 30 ms	try changing back to 10ms for the lols?	(interval links connect with, see per-class parameters)
+#define CONN_LATENCY	0
+#define CONN_TIMEOUT	MIN(MAX((CONN_INTERVAL * 125 * \
+			       		MAX(CONFIG_BT_MAX_CONN, 6) / 1000), 10), 3200)
+
+//#define SCAN_INTERVAL	400	// * 0.625 = 250 ms
+//#define SCAN_WINDOW		64	// * 0.625 = 40 ms
+
+struct bt_le_conn_param conn_param = {
+		.interval_min = CONN_INTERVAL,
+		.interval_max = CONN_INTERVAL,
+		.latency = CONN_LATENCY,
+		.timeout = CONN_TIMEOUT,
+	};
+
+struct bt_conn_le_create_param scan_param = {
+		.options = BT_CONN_LE_OPT_NONE,
+		//.interval = SCAN_INTERVAL,
+		//.window = SCAN_WINDOW,
+	};
+
+int bt_identity;	// self BT address/identity
+
+// Sensor classes
+#define SENSOR_INTERNAL			0	// 16 temp pixels + 24-bit pressure
+#define SENSOR_EXTERNAL_FRONT	1	// 32 temp pixels
+#define SENSOR_EXTERNAL_REAR	2	// 16 temp pixels
+#define TTPMS_NUM_CLASSES_BLE	3
+
+// Range each class' connection interval is adapted in (see connection parameters), 1.25 ms units.
+// Powers of two times CONN_INTERVAL so the links' connection events keep a regular pattern.
+static const struct {
+	uint16_t interval_min;
+	uint16_t interval_max;
+} conn_class_param[TTPMS_NUM_CLASSES_BLE] = {
+	[SENSOR_INTERNAL]		= { CONN_INTERVAL, CONN_INTERVAL * 4 },		// 30-120 ms, pressure changes slowly
+	[SENSOR_EXTERNAL_FRONT]	= { CONN_INTERVAL / 2, CONN_INTERVAL * 2 },	// 15-60 ms, twice the pixels of the others
+	[SENSOR_EXTERNAL_REAR]	= { CONN_INTERVAL, CONN_INTERVAL * 4 },		// 30-120 ms
+};
+
+#define CONNECTED_FLAG(position)	(IFL_CONNECTED_FLAG + (position))
+#define SUBSCRIBED_FLAG(sensor)	(IFL_SUBSCRIBED_FLAG + (sensor))
+#define PRES_SUBSCRIBED_FLAG(sensor)	(IFL_PRES_SUBSCRIBED_FLAG + (sensor))	// internal sensors only
+
+// Connection manager state of a sensor
+#define TTPMS_CONN_NEVER		0	// not connected since boot
+#define TTPMS_CONN_LOST			1	// was connected, waiting for it to come back
+#define TTPMS_CONN_UP			2
+
+// GATT handles of one sensor, discovered once and then cached in settings (NVS) under its address
+struct TTPMS_gatt_cache {
+	uint8_t db_hash[16];		// Database Hash (0x2B2A) of the sensor when the handles were discovered
+	uint16_t batt_handle;
+	uint16_t temp_handle;
+	uint16_t temp_ccc;
+	uint16_t pressure_handle;	// 0 if the sensor has no pressure characteristic
+	uint16_t pressure_ccc;
+	uint16_t mode_handle;		// 0 if the sensor has no mode characteristic
+};
+
+// Where a connected sensor is in getting its handles
+#define TTPMS_GATT_UNKNOWN		0	// not connected
+#define TTPMS_GATT_HASH			1	// reading the Database Hash to check the cache
+#define TTPMS_GATT_DISCOVERING	2	// cache missing or stale, discovering
+#define TTPMS_GATT_READY		3	// subscribe params have the right handles
+
+#define TTPMS_MODE_UNKNOWN		UINT8_MAX	// sensor mode not written on this connection yet
+
+// Where a sensor's link is, see link state machine
+#define TTPMS_LINK_IDLE			0	// not connected and not scanned for (scanning failed to start)
+#define TTPMS_LINK_SCANNING		1	// missing, auto-connect is running
+#define TTPMS_LINK_CONNECTED	2	// link up, checking the GATT cache or nothing enabled to stream
+#define TTPMS_LINK_DISCOVERING	3	// discovering handles
+#define TTPMS_LINK_SUBSCRIBING	4	// CCC write in flight
+#define TTPMS_LINK_STREAMING	5	// the sensor confirmed at least one subscription
+#define TTPMS_LINK_UNSUBSCRIBING	6	// CCC write in flight
+#define TTPMS_LINK_STATES		7
+
+#define TTPMS_STREAM_TEMP		0	// bits of streams
+#define TTPMS_STREAM_PRESSURE	1
+
+#define TTPMS_NOTIFY_LOG_TEMP_UNSUBSCRIBED		0	// bits of notify_log
+#define TTPMS_NOTIFY_LOG_TEMP_UNSUBSCRIBING		1
+#define TTPMS_NOTIFY_LOG_PRES_UNSUBSCRIBED		2
+#define TTPMS_NOTIFY_LOG_PRES_UNSUBSCRIBING		3
+#define TTPMS_NOTIFY_LOG_COUNT					4
+
+// Everything we know about one sensor position. Callbacks get back to their sensor with CONTAINER_OF on the
+// subscribe params, or through conn_sensor[bt_conn_index(conn)], so there's no searching by address after connecting.
+struct TTPMS_sensor {
+	const char *name;
+	const char *bt_id;			// default address, from ttpms_common.h (see sensor address table)
+	uint8_t index;				// IFL_SENSOR .... ERR_SENSOR, also the CAN TX source
+	uint8_t position;			// IFL_POSITION .... ERR_POSITION, what the sensor is called on CAN
+	uint8_t sensor_class;
+	uint8_t temp_len;			// bytes in a temp notification (one byte per pixel)
+	uint32_t temp_frame_id;		// first CAN ID of the temp frames
+	uint32_t pressure_frame_id;	// 0 for sensors without pressure
+	bt_addr_le_t addr;
+	struct bt_conn *conn;		// our reference while connected
+	struct bt_gatt_subscribe_params temp_subscribe_params;
+	struct bt_gatt_subscribe_params pressure_subscribe_params;
+	uint32_t pressure;			// latest pressure reading
+	atomic_t notifications;		// valid temp notifications received
+	atomic_t pressure_notifications;	// valid pressure readings received (separate or combined)
+	atomic_t samples;			// temp samples received (a batched notification carries several)
+	atomic_t invalid;			// notifications with unexpected length
+
+	// connection manager
+	uint8_t conn_state;			// TTPMS_CONN_*
+	int64_t missing_since;		// uptime (ms) the sensor went missing, 0 = boot
+	uint32_t first_connect_ms;	// time from boot to the first connection
+	uint16_t reconnects;
+	uint32_t reconnect_last_ms;	// time to reconnect after being lost
+	uint32_t reconnect_max_ms;
+	uint32_t reconnect_total_ms;
+	uint16_t conn_interval;		// current connection interval, 1.25 ms units
+	uint16_t requested_interval;	// last interval we asked for, 0 = none pending
+	atomic_val_t rate_notifications;	// notification count at the last rate check
+	uint16_t conn_handle;		// HCI handle, to match QoS reports and read RSSI
+	uint8_t phy;				// BT_GAP_LE_PHY_*, both directions use the same
+	uint8_t phy_hold;			// link checks left before the PHY may change again
+	uint16_t phy_changes;
+	int8_t rssi;				// dBm, averaged
+	atomic_t conn_events;		// connection events from QoS reports
+	atomic_t crc_errors;		// packets received with CRC errors, from QoS reports
+	atomic_val_t link_events;	// conn_events/crc_errors at the last link check
+	atomic_val_t link_crc_errors;
+	atomic_val_t link_samples;	// samples at the last link check
+	uint16_t delivered_rate;	// temp samples/s over the last link check
+
+	// sequence trailer, only touched by the notification thread (a new connection reaches it through conn_gen)
+	uint8_t conn_gen;			// bumped on every connection, only written by the BT RX thread
+	uint8_t seq_gen;			// conn_gen the sequence state below belongs to
+	bool seq_valid;				// seq/sensor_ms/seq_arrival are from this connection
+	uint16_t seq;				// sequence number of the newest sample
+	uint16_t sensor_ms;			// sensor timestamp of the newest sample
+	uint32_t seq_arrival;		// when the newest sample arrived
+	uint32_t seq_lost;			// samples missing in sequence gaps
+	uint32_t seq_gaps;
+	uint32_t seq_out_of_order;	// late or duplicate samples
+	uint32_t jitter;			// inter-arrival jitter, 1/16 ms scale
+
+	// GATT discovery / handle cache
+	uint8_t gatt_state;			// TTPMS_GATT_*
+	bool cached;				// cache holds handles loaded from (or saved to) settings
+	bool db_hash_ok;			// db_hash was read on this connection
+	uint8_t db_hash[16];
+	struct TTPMS_gatt_cache cache;
+	struct TTPMS_gatt_cache found;	// filled in by discovery
+	uint16_t service_end;
+	uint16_t temp_end;			// last handle that can belong to the temp characteristic (for its CCC)
+	uint16_t pressure_end;
+	uint16_t *open_end;			// end of the characteristic of ours discovered last, closed by the next one
+	struct bt_gatt_discover_params discover_params;
+	struct bt_gatt_read_params read_params;
+	struct k_work cache_save_work;
+	uint16_t mode_handle;		// from the cache or discovery, 0 = none
+	uint8_t mode;				// TTPMS_MODE_* last written, TTPMS_MODE_UNKNOWN after connecting
+
+	// link state machine
+	uint8_t link_state;			// TTPMS_LINK_*
+	uint32_t link_since;		// uptime (ms) of the last transition
+	uint32_t link_state_ms[TTPMS_LINK_STATES];	// time spent in each state before the current one
+	uint16_t link_transitions;
+	atomic_t streams;			// subscriptions the sensor confirmed, TTPMS_STREAM_* bits
+	atomic_t notify_log;		// what the notify callbacks left for main to log, TTPMS_NOTIFY_LOG_* bits
+	uint32_t connected_at;		// uptime (ms) the link came up, 0 once the first notification is in
+	uint32_t first_data_last_ms;	// connect to first notification
+	uint32_t first_data_max_ms;
+
+	// supervisor, only touched by main
+	uint32_t retry_at;			// uptime (ms) to retry a failed (un)subscribe, 0 = nothing to retry
+	uint16_t retry_ms;			// current back-off, 0 after a success
+};
+
+static uint8_t temp_notify_cb(struct bt_conn *conn, struct bt_gatt_subscribe_params *params, const void *data, uint16_t length);
+static void temp_subscribed_cb(struct bt_conn *conn, uint8_t err, struct bt_gatt_subscribe_params *params);
+static uint8_t pressure_notify_cb(struct bt_conn *conn, struct bt_gatt_subscribe_params *params, const void *data, uint16_t length);
+static void pressure_subscribed_cb(struct bt_conn *conn, uint8_t err, struct bt_gatt_subscribe_params *params);
+
+// Sensors may batch several samples into one notification to save connection events and ATT overhead. A batched
+// notification is N times (uint16_t little endian sensor timestamp in ms + one sample as it would be sent unbatched),
+// and is told apart from a single sample by its length.
+#define TTPMS_BATCH_TS_LEN			2
+#define TTPMS_BATCH_SPAN_MAX_MS		1000	// a batch never spreads out over more than this (bad timestamps)
+
+// Sensors may append a trailer to their temp notifications (single or batched), so loss can be told apart from a slow
+// sensor: uint16_t little endian sequence number of the newest sample (counts samples, so a batch of N moves it by N)
+// followed by the uint16_t little endian sensor timestamp of the newest sample in ms. It is also told apart by length,
+// none of the temp lengths with a trailer match one without. With a 2 byte timestamp the only way they can is a batch
+// stride (timestamp + sample) that divides the trailer length, e.g. 2 pixels: 1 sample + trailer = 2 samples = 8 bytes.
+// The Kconfig ranges of the pixel counts rule that out, the asserts below only back them up.
+#define TTPMS_SEQ_LEN				4
+
+// Combined samples are 3 bytes longer than the pixel count, so checking the bare pixel count covers them too
+#define TTPMS_SEQ_UNAMBIGUOUS(pixels)	(TTPMS_SEQ_LEN % (TTPMS_BATCH_TS_LEN + (pixels)) != 0)
+
+BUILD_ASSERT(TTPMS_SEQ_UNAMBIGUOUS(CONFIG_TTPMS_INTERNAL_PIXELS),
+	"CONFIG_TTPMS_INTERNAL_PIXELS makes batched and sequence trailer notifications the same length");
+BUILD_ASSERT(TTPMS_SEQ_UNAMBIGUOUS(CONFIG_TTPMS_EXTERNAL_FRONT_PIXELS),
+	"CONFIG_TTPMS_EXTERNAL_FRONT_PIXELS makes batched and sequence trailer notifications the same length");
+BUILD_ASSERT(TTPMS_SEQ_UNAMBIGUOUS(CONFIG_TTPMS_EXTERNAL_REAR_PIXELS),
+	"CONFIG_TTPMS_EXTERNAL_REAR_PIXELS makes batched and sequence trailer notifications the same length");
+
+// With combined notifications, the internal sensors' temp characteristic is needed for pressure too
+#define TTPMS_COMBINED(sensor)	\
+	(IS_ENABLED(CONFIG_TTPMS_COMBINED_TEMP_PRESSURE) && (sensor)->sensor_class == SENSOR_INTERNAL)
+
+// NOTE: each sensor needs to have its own subscribe_params variable since it remains tied to each subscription (from Zephyr docs)
+// Handles are filled in once they are known (see GATT discovery / handle cache)
+#define TTPMS_SENSOR(pos, cls, len, pressure_id)				\
+	[pos##_SENSOR] = {											\
+		.name = #pos,											\
+		.bt_id = TTPMS_##pos##_BT_ID,							\
+		.index = pos##_SENSOR,									\
+		.position = pos##_POSITION,								\
+		.sensor_class = cls,									\
+		.temp_len = len,										\
+		.temp_frame_id = pos##_TEMP_FRAME_ID,					\
+		.pressure_frame_id = pressure_id,						\
+		.temp_subscribe_params = {								\
+			.value = BT_GATT_CCC_NOTIFY,						\
+			.notify = temp_notify_cb,							\
+			.subscribe = temp_subscribed_cb,					\
+		},														\
+		.pressure_subscribe_params = {							\
+			.value = BT_GATT_CCC_NOTIFY,						\
+			.notify = pressure_notify_cb,						\
+			.subscribe = pressure_subscribed_cb,				\
+		},														\
+	}
+
+// Only the positions fitted in the sensor topology (Kconfig) are in the table
+static struct TTPMS_sensor sensors[TTPMS_NUM_SENSORS] = {
+	IF_ENABLED(CONFIG_TTPMS_SENSOR_IFL, (TTPMS_SENSOR(IFL, SENSOR_INTERNAL, CONFIG_TTPMS_INTERNAL_PIXELS, FL_PRESSURE_FRAME_ID),))
+	IF_ENABLED(CONFIG_TTPMS_SENSOR_IFR, (TTPMS_SENSOR(IFR, SENSOR_INTERNAL, CONFIG_TTPMS_INTERNAL_PIXELS, FR_PRESSURE_FRAME_ID),))
+	IF_ENABLED(CONFIG_TTPMS_SENSOR_IRL, (TTPMS_SENSOR(IRL, SENSOR_INTERNAL, CONFIG_TTPMS_INTERNAL_PIXELS, RL_PRESSURE_FRAME_ID),))
+	IF_ENABLED(CONFIG_TTPMS_SENSOR_IRR, (TTPMS_SENSOR(IRR, SENSOR_INTERNAL, CONFIG_TTPMS_INTERNAL_PIXELS, RR_PRESSURE_FRAME_ID),))
+	IF_ENABLED(CONFIG_TTPMS_SENSOR_EFL, (TTPMS_SENSOR(EFL, SENSOR_EXTERNAL_FRONT, CONFIG_TTPMS_EXTERNAL_FRONT_PIXELS, 0),))
+	IF_ENABLED(CONFIG_TTPMS_SENSOR_EFR, (TTPMS_SENSOR(EFR, SENSOR_EXTERNAL_FRONT, CONFIG_TTPMS_EXTERNAL_FRONT_PIXELS, 0),))
+	IF_ENABLED(CONFIG_TTPMS_SENSOR_ERL, (TTPMS_SENSOR(ERL, SENSOR_EXTERNAL_REAR, CONFIG_TTPMS_EXTERNAL_REAR_PIXELS, 0),))
+	IF_ENABLED(CONFIG_TTPMS_SENSOR_ERR, (TTPMS_SENSOR(ERR, SENSOR_EXTERNAL_REAR, CONFIG_TTPMS_EXTERNAL_REAR_PIXELS, 0),))
+};
+
+const char *TTPMS_sensor_name(uint8_t index)
+{
+	return sensors[index].name;
+}
+
+// sensor on each connection, indexed by bt_conn_index()
+static struct TTPMS_sensor *conn_sensor[CONFIG_BT_MAX_CONN];
+
+// sensor addresses are written by addr_work (provisioning) while the BT RX thread looks them up
+static struct k_spinlock addr_lock;
+
+static struct TTPMS_sensor *sensor_from_addr(const bt_addr_le_t *addr)
+{
+	struct TTPMS_sensor *sensor = NULL;
+	k_spinlock_key_t key = k_spin_lock(&addr_lock);
+
+	for (int i = 0; i < TTPMS_NUM_SENSORS; i++) {
+		if (bt_addr_le_eq(addr, &sensors[i].addr)) {
+			sensor = &sensors[i];
+			break;
+		}
+	}
+
+	k_spin_unlock(&addr_lock, key);
+	return sensor;
+}
+
+// sensor->conn is set and cleared by connected()/disconnected() in the BT RX thread. Everyone else takes their own
+// reference under conn_lock and uses that, so a disconnect in between can't hand the stack a NULL or freed connection.
+static struct k_spinlock conn_lock;
+
+// Reference to the sensor's connection (bt_conn_unref() it when done), NULL if it isn't connected
+static struct bt_conn *TTPMS_sensor_conn(struct TTPMS_sensor *sensor)
+{
+	k_spinlock_key_t key = k_spin_lock(&conn_lock);
+	struct bt_conn *conn = sensor->conn ? bt_conn_ref(sensor->conn) : NULL;
+
+	k_spin_unlock(&conn_lock, key);
+	return conn;
+}
+
+/* supervisor */
+
+// main() sleeps until something needs doing: a sensor's subscriptions need checking (GATT ready, subscription done or
+// failed, settings changed via CAN), a failed (un)subscribe is due for a retry, or a timer for the diagnostics row,
+// status frame or stats log went off. Anything can post events or kick a sensor, main is the only one that (un)subscribes.
+
+#define TTPMS_EVT_SUBSCRIBE		BIT(0)	// check the sensors in supervisor_sensors
+#define TTPMS_EVT_DIAG			BIT(1)	// every 100ms
+#define TTPMS_EVT_STATUS		BIT(2)	// every 500ms
+#define TTPMS_EVT_STATS			BIT(3)	// every 10s
+#define TTPMS_EVT_NOTIFY_LOG	BIT(4)	// a notify callback has something to log (see notification hand-off)
+
+#define TTPMS_RETRY_MIN_MS		100		// first retry after a failed (un)subscribe, doubles every failure
+#define TTPMS_RETRY_MAX_MS		5000
+
+static atomic_t supervisor_events;
+static atomic_t supervisor_sensors;	// sensors whose subscriptions need checking
+static atomic_t supervisor_failed;	// sensors whose (un)subscribe failed in the BT stack, retried after back-off
+static K_SEM_DEFINE(supervisor_sem, 0, 1);
+
+static void TTPMS_supervisor_post(atomic_val_t events)
+{
+	atomic_or(&supervisor_events, events);
+	k_sem_give(&supervisor_sem);
+}
+
+// Have main check a sensor's subscriptions, from any context
+static void TTPMS_supervisor_kick(uint8_t index)
+{
+	atomic_set_bit(&supervisor_sensors, index);
+	TTPMS_supervisor_post(TTPMS_EVT_SUBSCRIBE);
+}
+
+static void TTPMS_supervisor_failed(uint8_t index)
+{
+	atomic_set_bit(&supervisor_failed, index);
+	TTPMS_supervisor_post(TTPMS_EVT_SUBSCRIBE);
+}
+
+/* link state machine */
+
+// Every sensor's link goes idle -> scanning -> connected (-> discovering) -> subscribing -> streaming, and through
+// unsubscribing back to connected when nothing is enabled, with every transition timestamped. The time spent in each
+// state and the time from connecting to the first notification show where a reconnect spends its time. The host can't
+// tell which sensor auto-connect is connecting to until the link is up, so there is no separate connecting state.
+// Transitions come from the BT RX thread, the workqueue, main and the notification thread.
+
+static const char *const link_state_names[TTPMS_LINK_STATES] = {
+	"idle", "scanning", "connected", "discovering", "subscribing", "streaming", "unsubscribing",
+};
+
+static struct k_spinlock link_lock;
+
+static void TTPMS_link_set(struct TTPMS_sensor *sensor, uint8_t state)
+{
+	k_spinlock_key_t key = k_spin_lock(&link_lock);
+	uint32_t now = k_uptime_get_32();
+
+	if (sensor->link_state != state) {
+		sensor->link_state_ms[sensor->link_state] += now - sensor->link_since;
+		sensor->link_since = now;
+		sensor->link_state = state;
+		sensor->link_transitions++;
+	}
+
+	k_spin_unlock(&link_lock, key);
+}
+
+// A CCC write finished (or the link lost a subscription), streaming if anything is still subscribed
+static void TTPMS_link_settle(struct TTPMS_sensor *sensor)
+{
+	TTPMS_link_set(sensor, atomic_get(&sensor->streams) ? TTPMS_LINK_STREAMING : TTPMS_LINK_CONNECTED);
+}
+
+// Called by the notification thread for every valid notification
+static void TTPMS_link_data(struct TTPMS_sensor *sensor, uint32_t arrival)
+{
+	uint32_t connected_at = sensor->connected_at;
+	uint32_t elapsed;
+
+	if (connected_at == 0) {
+		return;
+	}
+
+	elapsed = arrival - connected_at;
+	sensor->connected_at = 0;
+	sensor->first_data_last_ms = elapsed;
+	sensor->first_data_max_ms = MAX(sensor->first_data_max_ms, elapsed);
+	LOG_INF("%s: first notification %u ms after connecting", sensor->name, elapsed);
+}
+
+// Time spent in a state up to now
+static uint32_t TTPMS_link_state_ms(struct TTPMS_sensor *sensor, uint8_t state, uint32_t now)
+{
+	k_spinlock_key_t key = k_spin_lock(&link_lock);
+	uint32_t ms = sensor->link_state_ms[state] + ((sensor->link_state == state) ? now - sensor->link_since : 0);
+
+	k_spin_unlock(&link_lock, key);
+	return ms;
+}
+
+static void TTPMS_link_log_stats(struct TTPMS_sensor *sensor)
+{
+	uint32_t now = k_uptime_get_32();
+	char line[128];
+	int len = 0;
+
+	for (int i = 0; i < TTPMS_LINK_STATES; i++) {
+		len += snprintk(line + len, sizeof(line) - len, "%s %s %u s", i ? "," : "", link_state_names[i],
+			TTPMS_link_state_ms(sensor, i, now) / 1000);
+		if (len >= sizeof(line)) {
+			break;
+		}
+	}
+
+	LOG_INF("%s: %s for %u ms, %u transitions, first notification after %u ms (max %u ms), time in state:%s",
+		sensor->name, link_state_names[sensor->link_state], now - sensor->link_since, sensor->link_transitions,
+		sensor->first_data_last_ms, sensor->first_data_max_ms, line);
+}
+
+// Link state rows of the diagnostics frame (see TTPMS_DIAG_FRAME_ID)
+void TTPMS_link_diag_row(uint8_t index, uint8_t *data)
+{
+	struct TTPMS_sensor *sensor = &sensors[index % TTPMS_NUM_SENSORS];
+	uint32_t now = k_uptime_get_32();
+
+	if (index >= TTPMS_NUM_SENSORS) {
+		for (int i = 0; i < TTPMS_LINK_STATES; i++) {
+			data[1 + i] = (uint64_t)TTPMS_link_state_ms(sensor, i, now) * 100 / MAX(now, 1);
+		}
+		return;
+	}
+
+	data[1] = sensor->link_state;
+	sys_put_le16(MIN((now - sensor->link_since) / 100, UINT16_MAX), &data[2]);
+	sys_put_le16(MIN(sensor->first_data_last_ms, UINT16_MAX), &data[4]);
+	sys_put_le16(MIN(sensor->first_data_max_ms, UINT16_MAX), &data[6]);
+}
+
+/* connection manager */
+
+// All sensors are found by one auto-connect (filter accept list) scan. How hard we scan depends on how long the most
+// recently lost sensor has been missing: a dropped wheel is looked for with fast scanning, and if it doesn't come back
+// the scan interval doubles every time its missing time doubles, down to slow scanning. Sensors that never showed up
+// since boot (not fitted) back off the same way. Once every sensor is connected, scanning stops entirely.
+//
+// Scanning shares the radio with the connection events of the links that are streaming. The SDC tends to pack the
+// central connection events back to back, each taking up to the connection event length, so with n links there is
+// usually a free gap of about CONN_INTERVAL - n * event length in every connection interval. As a best-effort heuristic
+// the scan window is cut down to that gap and the scan interval is a whole number of connection intervals, so the
+// window is less likely to drift across the connection events. The SDC scheduler doesn't promise where it puts the
+// window, it may still overlap (and then lose to, or delay) connection events. Auto-connect is only restarted when the
+// scan parameters actually change (and after each connection, which ends auto-connect).
+
+#define TTPMS_SCAN_LEVEL_SLOW	5	// BT_GAP_SCAN_FAST_INTERVAL << 5 is past BT_GAP_SCAN_SLOW_INTERVAL_1
+
+#ifdef CONFIG_BT_CTLR_SDC_MAX_CONN_EVENT_LEN_DEFAULT
+#define TTPMS_CONN_EVENT_LEN_US	CONFIG_BT_CTLR_SDC_MAX_CONN_EVENT_LEN_DEFAULT
+#else
+#define TTPMS_CONN_EVENT_LEN_US	7500	// SDC default
+#endif
+#define TTPMS_SCAN_GUARD_US		1250	// scheduling margin around the scan window
+#define TTPMS_SCAN_WINDOW_MIN	4		// * 0.625 = 2.5 ms, still enough to catch an advertising event
+
+static struct k_work_delayable conn_mgr_work;
+static atomic_t conn_mgr_scanning;		// auto-connect is running
+static atomic_t conn_mgr_scan_duty;		// duty cycle of the running scan, 0.1% scale (0 = not scanning)
+static atomic_t conn_mgr_hold;			// auto-connect held off while a sensor address is being replaced
+
+// 0 = fast scanning .... TTPMS_SCAN_LEVEL_SLOW = slow scanning
+static int TTPMS_conn_mgr_scan_level(int missing, int64_t freshest_ms)
+{
+	int level = 0;
+
+	// one level per doubling of the missing time past CONFIG_TTPMS_SCAN_FAST_MS
+	for (int64_t t = CONFIG_TTPMS_SCAN_FAST_MS; freshest_ms >= t && level < TTPMS_SCAN_LEVEL_SLOW; t *= 2) {
+		level++;
+	}
+
+	// with most sensors missing (e.g. car just started), streaming links have the radio time to spare
+	if (missing > TTPMS_NUM_SENSORS / 2 && level > 0) {
+		level--;
+	}
+
+	return level;
+}
+
+// Radio time the connected links take per CONN_INTERVAL. Links with longer intervals take a share of it.
+static uint32_t TTPMS_conn_mgr_busy_us(void)
+{
+	uint32_t busy_us = 0;
+
+	for (int i = 0; i < TTPMS_NUM_SENSORS; i++) {
+		if (sensors[i].conn_state == TTPMS_CONN_UP) {
+			busy_us += TTPMS_CONN_EVENT_LEN_US * CONN_INTERVAL / MAX(sensors[i].conn_interval, 1);
+		}
+	}
+	return busy_us;
+}
+
+// Scan interval/window for a scan level, fitted around the connection events of the connected links
+static void TTPMS_conn_mgr_scan_params(int level, int connected, uint16_t *interval, uint16_t *window)
+{
+	uint32_t conn_interval_us = CONN_INTERVAL * 1250;
+	uint32_t busy_us = TTPMS_conn_mgr_busy_us() + TTPMS_SCAN_GUARD_US;
+	uint16_t gap = (busy_us < conn_interval_us) ? (conn_interval_us - busy_us) / 625 : 0;	// * 0.625 ms
+
+	if (level >= TTPMS_SCAN_LEVEL_SLOW) {
+		*interval = BT_GAP_SCAN_SLOW_INTERVAL_1;
+		*window = BT_GAP_SCAN_SLOW_WINDOW_1;
+	} else {
+		*interval = BT_GAP_SCAN_FAST_INTERVAL << level;
+		*window = BT_GAP_SCAN_FAST_WINDOW;
+	}
+
+	if (connected) {
+		*interval = ROUND_UP(*interval, CONN_INTERVAL * 2);	// 1.25 ms units -> 0.625 ms units
+		*window = MIN(*window, MAX(gap, TTPMS_SCAN_WINDOW_MIN));
+	}
+}
+
+static void TTPMS_conn_mgr_work_handler(struct k_work *work)
+{
+	static uint16_t scan_interval;	// what auto-connect was started with
+	static uint16_t scan_window;
+	int64_t now = k_uptime_get();
+	int64_t freshest_ms = INT64_MAX;
+	int missing = 0;
+	uint16_t interval;
+	uint16_t window;
+	int err;
+
+	if (atomic_get(&conn_mgr_hold)) {	// the accept list is about to change, addr_work starts us again
+		return;
+	}
+
+	for (int i = 0; i < TTPMS_NUM_SENSORS; i++) {
+		if (sensors[i].conn_state != TTPMS_CONN_UP) {
+			missing++;
+			freshest_ms = MIN(freshest_ms, now - sensors[i].missing_since);
+		}
+	}
+
+	if (missing == 0) {	// all the radio time goes to the links
+		if (atomic_get(&conn_mgr_scanning)) {
+			err = bt_conn_create_auto_stop();
+			if (err) {
+				LOG_ERR("Failed to stop automatically connecting (err %d)", err);
+			}
+			atomic_set(&conn_mgr_scanning, 0);
+		}
+		if (atomic_set(&conn_mgr_scan_duty, 0) != 0 || scan_interval) {
+			LOG_INF("All sensors connected, scanning paused");
+		}
+		scan_interval = 0;
+		return;
+	}
+
+	TTPMS_conn_mgr_scan_params(TTPMS_conn_mgr_scan_level(missing, freshest_ms), TTPMS_NUM_SENSORS - missing,
+		&interval, &window);
+
+	if (!atomic_get(&conn_mgr_scanning) || interval != scan_interval || window != scan_window) {
+
+		if (atomic_get(&conn_mgr_scanning)) {
+			err = bt_conn_create_auto_stop();
+			if (err) {
+				LOG_ERR("Failed to stop automatically connecting (err %d)", err);
+			}
+		}
+
+		scan_param.interval = interval;
+		scan_param.window = window;
+
+		atomic_set(&conn_mgr_scanning, 1);	// before starting, connected() may run before this returns
+		err = bt_conn_le_create_auto(&scan_param, &conn_param);
+		if (err) {
+			atomic_set(&conn_mgr_scanning, 0);
+			atomic_set(&conn_mgr_scan_duty, 0);
+			LOG_ERR("Failed to start automatically connecting (err %d)", err);
+		} else {
+			if (interval != scan_interval || window != scan_window) {
+				LOG_INF("Scanning every %u ms for %u ms, %d sensors missing",
+					interval * 625 / 1000, window * 625 / 1000, missing);
+			}
+			scan_interval = interval;
+			scan_window = window;
+			atomic_set(&conn_mgr_scan_duty, window * 1000 / interval);
+		}
+	}
+
+	for (int i = 0; i < TTPMS_NUM_SENSORS; i++) {
+		if (sensors[i].conn_state != TTPMS_CONN_UP) {
+			TTPMS_link_set(&sensors[i], atomic_get(&conn_mgr_scanning) ? TTPMS_LINK_SCANNING : TTPMS_LINK_IDLE);
+		}
+	}
+
+	// keep backing off (or retry a failed start) while anything is missing
+	k_work_schedule(&conn_mgr_work, K_SECONDS(1));
+}
+
+// Notification rate of the subscribed links, binned by the scan duty cycle at the time. Comparing the rate while scanning
+// with the rate while not scanning shows how many notifications scanning costs.
+static const uint16_t scan_stats_duty[] = {0, 20, 50, 100, 250, 1000};	// upper bounds, 0.1% scale
+
+struct TTPMS_scan_stats {
+	uint32_t notifications;
+	uint32_t link_ms;		// time summed over all subscribed links
+};
+
+static struct TTPMS_scan_stats scan_stats[ARRAY_SIZE(scan_stats_duty)];
+
+// Called periodically from main
+void TTPMS_scan_stats_sample(void)
+{
+	static int64_t last_time;
+	static atomic_val_t last_notifications[TTPMS_NUM_SENSORS];
+	int64_t elapsed_ms = k_uptime_delta(&last_time);
+	atomic_val_t duty = atomic_get(&conn_mgr_scan_duty);
+	struct TTPMS_scan_stats *bin = &scan_stats[ARRAY_SIZE(scan_stats) - 1];
+
+	for (int i = 0; i < ARRAY_SIZE(scan_stats_duty); i++) {
+		if (duty <= scan_stats_duty[i]) {
+			bin = &scan_stats[i];
+			break;
+		}
+	}
+
+	for (int i = 0; i < TTPMS_NUM_SENSORS; i++) {
+		atomic_val_t notifications = atomic_get(&sensors[i].notifications);
+
+		if (atomic_test_bit(flags, SUBSCRIBED_FLAG(i))) {
+			bin->notifications += notifications - last_notifications[i];
+			bin->link_ms += elapsed_ms;
+		}
+		last_notifications[i] = notifications;
+	}
+}
+
+static void TTPMS_scan_stats_log(void)
+{
+	uint32_t idle_rate = 0;	// notifications per link-second * 100
+
+	for (int i = 0; i < ARRAY_SIZE(scan_stats); i++) {
+		if (scan_stats[i].link_ms == 0) {
+			continue;
+		}
+
+		uint32_t rate = (uint64_t)scan_stats[i].notifications * 100000 / scan_stats[i].link_ms;
+
+		if (i == 0) {
+			idle_rate = rate;
+			LOG_INF("Not scanning: %u.%02u notifications/s per link over %u s", rate / 100, rate % 100,
+				scan_stats[i].link_ms / 1000);
+		} else {
+			LOG_INF("Scan duty <= %u.%u%%: %u.%02u notifications/s per link over %u s, %d%% lost vs not scanning",
+				scan_stats_duty[i] / 10, scan_stats_duty[i] % 10, rate / 100, rate % 100,
+				scan_stats[i].link_ms / 1000, idle_rate ? 100 - (int)(rate * 100 / idle_rate) : 0);
+		}
+	}
+}
+
+static void TTPMS_conn_mgr_connected(struct TTPMS_sensor *sensor)
+{
+	uint32_t elapsed = k_uptime_get() - sensor->missing_since;
+
+	if (sensor->conn_state == TTPMS_CONN_NEVER) {
+		sensor->first_connect_ms = elapsed;
+	} else {
+		sensor->reconnects++;
+		sensor->reconnect_last_ms = elapsed;
+		sensor->reconnect_max_ms = MAX(sensor->reconnect_max_ms, elapsed);
+		sensor->reconnect_total_ms += elapsed;
+		LOG_INF("%s back after %u ms", sensor->name, elapsed);
+	}
+
+	sensor->conn_state = TTPMS_CONN_UP;
+	sensor->conn_gen++;	// the sensor may have restarted its sequence, see the notification thread
+}
+
+static void TTPMS_conn_mgr_disconnected(struct TTPMS_sensor *sensor)
+{
+	sensor->conn_state = TTPMS_CONN_LOST;
+	sensor->missing_since = k_uptime_get();
+}
+
+void TTPMS_notify_log_stats(void);
+void TTPMS_chan_log_stats(void);
+
+void TTPMS_BLE_log_stats(void)
+{
+	TTPMS_scan_stats_log();
+	TTPMS_notify_log_stats();
+	TTPMS_chan_log_stats();
+
+	for (int i = 0; i < TTPMS_NUM_SENSORS; i++) {
+		struct TTPMS_sensor *sensor = &sensors[i];
+
+		if (sensor->conn_state == TTPMS_CONN_NEVER) {
+			LOG_INF("%s: never connected", sensor->name);
+			continue;
+		}
+
+		LOG_INF("%s: %s, interval %u ms, PHY %u, RSSI %d dBm, CRC errors %ld/%ld, first connect %u ms, reconnects %u (last %u ms, max %u ms, avg %u ms), notifications %ld (samples %ld), invalid %ld",
+			sensor->name, sensor->conn_state == TTPMS_CONN_UP ? "up" : "lost", sensor->conn_interval * 125 / 100,
+			sensor->phy, sensor->rssi, atomic_get(&sensor->crc_errors), atomic_get(&sensor->conn_events),
+			sensor->first_connect_ms,
+			sensor->reconnects, sensor->reconnect_last_ms, sensor->reconnect_max_ms,
+			sensor->reconnects ? sensor->reconnect_total_ms / sensor->reconnects : 0,
+			atomic_get(&sensor->notifications), atomic_get(&sensor->samples), atomic_get(&sensor->invalid));
+		LOG_INF("%s: delivered %u samples/s, lost %u in %u gaps, out of order %u, jitter %u ms",
+			sensor->name, sensor->delivered_rate, sensor->seq_lost, sensor->seq_gaps, sensor->seq_out_of_order,
+			sensor->jitter / 16);
+		TTPMS_link_log_stats(sensor);
+	}
+}
+
+// Link, radio and delivery rows of the diagnostics frame (see TTPMS_DIAG_FRAME_ID)
+void TTPMS_BLE_diag_row(uint8_t index, uint8_t *data)
+{
+	const struct TTPMS_sensor *sensor = &sensors[index % TTPMS_NUM_SENSORS];
+
+	if (index >= 2 * TTPMS_NUM_SENSORS) {
+		data[1] = sensor->rssi;
+		data[2] = MIN(sensor->delivered_rate, UINT8_MAX);
+		sys_put_le16(sensor->seq_lost, &data[3]);
+		data[5] = sensor->seq_gaps;
+		data[6] = sensor->seq_out_of_order;
+		data[7] = MIN(sensor->jitter / 16, UINT8_MAX);
+		return;
+	}
+
+	if (index >= TTPMS_NUM_SENSORS) {
+		data[1] = (sensor->conn_state == TTPMS_CONN_UP) ? sensor->phy : 0;
+		data[2] = sensor->rssi;
+		sys_put_le16(atomic_get(&sensor->conn_events), &data[3]);
+		sys_put_le16(atomic_get(&sensor->crc_errors), &data[5]);
+		data[7] = MIN(sensor->conn_interval, UINT8_MAX);
+		return;
+	}
+
+	data[1] = sensor->conn_state;
+	sys_put_le16(sensor->reconnects, &data[2]);
+	sys_put_le16(MIN(sensor->reconnect_last_ms / 10, UINT16_MAX), &data[4]);
+	sys_put_le16(MIN(sensor->reconnect_max_ms / 10, UINT16_MAX), &data[6]);
+}
+
+/* connection parameters */
+
+// Auto-connect connects every sensor with conn_param. After that each link gets the connection interval range of its
+// class, and every CONFIG_TTPMS_CONN_ADAPT_MS the interval is moved within that range to follow the link's notification
+// rate (capped at the rate the CAN budget lets us send): if most connection events carry a sample the interval is
+// halved, if less than half of them would after doubling it, it is doubled. Links with nothing to send (e.g. temp
+// disabled) end up at the longest interval of their class and leave the air time to the others.
+
+#define TTPMS_CONN_EVENTS_FULL	900		// samples per connection event (0.1% scale) above which the interval is halved
+#define TTPMS_CONN_EVENTS_IDLE	400		// samples per connection event (0.1% scale) below which the interval is doubled
+
+static struct k_work_delayable conn_param_work;
+
+static int TTPMS_conn_param_request(struct TTPMS_sensor *sensor, uint16_t interval)
+{
+	// supervision timeout of 6 intervals (10 ms units), the spec needs more than 2
+	struct bt_le_conn_param param = {
+		.interval_min = interval,
+		.interval_max = interval,
+		.latency = 0,
+		.timeout = MAX(CONN_TIMEOUT, interval * 125 * 6 / 1000),
+	};
+	struct bt_conn *conn = TTPMS_sensor_conn(sensor);
+	int err;
+
+	if (!conn) {
+		return -ENOTCONN;	// disconnected since the caller checked
+	}
+
+	err = bt_conn_le_param_update(conn, &param);
+	bt_conn_unref(conn);
+	if (err) {
+		LOG_WRN("%s: Failed to update connection interval (err %d)", sensor->name, err);
+	} else {
+		sensor->requested_interval = interval;
+	}
+	return err;
+}
+
+// Called on connect, start at the shortest interval of the class until we know the rate
+static void TTPMS_conn_param_connected(struct TTPMS_sensor *sensor, struct bt_conn *conn)
+{
+	struct bt_conn_info info;
+
+	sensor->conn_interval = CONN_INTERVAL;
+	if (bt_conn_get_info(conn, &info) == 0) {
+		sensor->conn_interval = info.le.interval;
+	}
+	sensor->requested_interval = 0;
+	sensor->rate_notifications = atomic_get(&sensor->notifications);
+
+	if (sensor->conn_interval != conn_class_param[sensor->sensor_class].interval_min) {
+		TTPMS_conn_param_request(sensor, conn_class_param[sensor->sensor_class].interval_min);
+	}
+}
+
+static void TTPMS_conn_param_work_handler(struct k_work *work)
+{
+	static int64_t last_time;
+	int64_t elapsed_ms = k_uptime_delta(&last_time);
+
+	for (int i = 0; i < TTPMS_NUM_SENSORS; i++) {
+		struct TTPMS_sensor *sensor = &sensors[i];
+		atomic_val_t notifications = atomic_get(&sensor->notifications);
+		uint32_t delta = notifications - sensor->rate_notifications;
+
+		sensor->rate_notifications = notifications;
+
+		// skip links that aren't up, and give an update in progress one period to finish (the sensor may never answer)
+		if (sensor->conn_state != TTPMS_CONN_UP || sensor->requested_interval || elapsed_ms <= 0) {
+			sensor->requested_interval = 0;
+			continue;
+		}
+
+		// samples/s we can use: what arrives, but no more than the CAN budget of the sensor can send (mHz)
+		// (pressure on its own is slow enough for the longest interval of any class, so only temp counts)
+		uint32_t rate = MIN((uint64_t)delta * 1000000U / elapsed_ms,	// 64 bit, delta * 10^6 overflows past 4294 samples
+			CONFIG_TTPMS_CAN_BUDGET_SENSOR * 1000 / DIV_ROUND_UP(sensor->temp_len, CAN_MAX_DLEN));
+		uint16_t interval = sensor->conn_interval;
+		uint32_t per_event = (uint64_t)rate * interval * 125 / 100000;	// samples per connection event, 0.1% scale
+
+		if (per_event > TTPMS_CONN_EVENTS_FULL && interval / 2 >= conn_class_param[sensor->sensor_class].interval_min) {
+			interval /= 2;
+		} else if (per_event < TTPMS_CONN_EVENTS_IDLE && interval * 2 <= conn_class_param[sensor->sensor_class].interval_max) {
+			interval *= 2;
+		}
+
+		if (interval != sensor->conn_interval) {
+			LOG_INF("%s: %u.%03u samples/s, connection interval %u -> %u ms", sensor->name, rate / 1000, rate % 1000,
+				sensor->conn_interval * 125 / 100, interval * 125 / 100);
+			TTPMS_conn_param_request(sensor, interval);
+		}
+	}
+
+	k_work_schedule(&conn_param_work, K_MSEC(CONFIG_TTPMS_CONN_ADAPT_MS));
+}
+
+// Sensors may ask for parameters too, keep them inside their class' range
+static bool le_param_req(struct bt_conn *conn, struct bt_le_conn_param *param)
+{
+	struct TTPMS_sensor *sensor = conn_sensor[bt_conn_index(conn)];
+
+	if (sensor) {
+		param->interval_min = CLAMP(param->interval_min, conn_class_param[sensor->sensor_class].interval_min,
+			conn_class_param[sensor->sensor_class].interval_max);
+		param->interval_max = CLAMP(param->interval_max, param->interval_min,
+			conn_class_param[sensor->sensor_class].interval_max);
+	}
+	return true;
+}
+
+static void le_param_updated(struct bt_conn *conn, uint16_t interval, uint16_t latency, uint16_t timeout)
+{
+	struct TTPMS_sensor *sensor = conn_sensor[bt_conn_index(conn)];
+
+	if (sensor) {
+		sensor->conn_interval = interval;
+		sensor->requested_interval = 0;
+		k_work_reschedule(&conn_mgr_work, K_NO_WAIT);	// scan window depends on the intervals
+	}
+}
+
+/* channel map */
+
+// Wi-Fi in the paddock sits on top of some of the 37 data channels. The QoS connection event reports say which channel
+// every connection event of every link was on, so every CONFIG_TTPMS_CHAN_MAP_MS each channel's share of bad events
+// (a CRC error, or nothing heard from the sensor) is worked out and the worst channels are taken out of the host channel
+// map with bt_le_set_chan_map, which the controller applies to all links. Excluded channels get no events so they can't
+// be judged; they are let back in after CONFIG_TTPMS_CHAN_READMIT_MS and excluded again if they're still bad.
+
+#define TTPMS_NUM_CHANNELS		37		// BLE data channels
+#define TTPMS_CHAN_BAD			250		// bad events per event, 0.1% scale, above this a channel is excluded
+#define TTPMS_CHAN_MIN_EVENTS	20		// events a channel needs in a period to be judged
+#define TTPMS_CHAN_MIN_USED		20		// never use fewer channels than this (hopping needs room)
+#define TTPMS_CHAN_NO_DATA		UINT8_MAX
+
+static atomic_t chan_events[TTPMS_NUM_CHANNELS];	// from QoS reports, since the last period
+static atomic_t chan_bad[TTPMS_NUM_CHANNELS];
+static uint8_t chan_quality[TTPMS_NUM_CHANNELS];	// bad events last period, %, TTPMS_CHAN_NO_DATA if not judged
+static uint32_t chan_excluded_until[TTPMS_NUM_CHANNELS];	// uptime (ms) to let an excluded channel back in, 0 = in use
+static uint8_t chan_map[5] = {0xff, 0xff, 0xff, 0xff, 0x1f};	// what the controller has
+static uint16_t chan_map_updates;
+static struct k_work_delayable chan_map_work;
+
+// Called from the QoS report of every connection event (BT RX thread)
+static void TTPMS_chan_event(uint8_t channel, bool bad)
+{
+	if (channel >= TTPMS_NUM_CHANNELS) {
+		return;
+	}
+
+	atomic_inc(&chan_events[channel]);
+	if (bad) {
+		atomic_inc(&chan_bad[channel]);
+	}
+}
+
+static void TTPMS_chan_map_work_handler(struct k_work *work)
+{
+	uint32_t now = k_uptime_get_32();
+	uint16_t rate[TTPMS_NUM_CHANNELS];	// bad events per event, 0.1% scale
+	uint8_t map[5] = {0};
+	uint8_t used = 0;
+	int err;
+
+	for (int i = 0; i < TTPMS_NUM_CHANNELS; i++) {
+		atomic_val_t events = atomic_set(&chan_events[i], 0);
+		atomic_val_t bad = MIN(atomic_set(&chan_bad[i], 0), events);
+
+		rate[i] = (events >= TTPMS_CHAN_MIN_EVENTS) ? bad * 1000 / events : 0;
+		chan_quality[i] = (events >= TTPMS_CHAN_MIN_EVENTS) ? rate[i] / 10 : TTPMS_CHAN_NO_DATA;
+
+		if (chan_excluded_until[i] && (int32_t)(now - chan_excluded_until[i]) >= 0) {
+			chan_excluded_until[i] = 0;
+		}
+		if (!chan_excluded_until[i]) {
+			used++;
+		}
+	}
+
+	// worst first, so the channels kept when hitting TTPMS_CHAN_MIN_USED are the better ones
+	for (; used > TTPMS_CHAN_MIN_USED; used--) {
+		int worst = -1;
+
+		for (int i = 0; i < TTPMS_NUM_CHANNELS; i++) {
+			if (!chan_excluded_until[i] && rate[i] > TTPMS_CHAN_BAD && (worst < 0 || rate[i] > rate[worst])) {
+				worst = i;
+			}
+		}
+		if (worst < 0) {
+			break;
+		}
+
+		chan_excluded_until[worst] = MAX(now + CONFIG_TTPMS_CHAN_READMIT_MS, 1);
+		LOG_INF("Channel %d excluded (%u.%u%% bad connection events)", worst, rate[worst] / 10, rate[worst] % 10);
+	}
+
+	for (int i = 0; i < TTPMS_NUM_CHANNELS; i++) {
+		if (!chan_excluded_until[i]) {
+			map[i / 8] |= BIT(i % 8);
+		}
+	}
+
+	if (memcmp(map, chan_map, sizeof(map))) {
+		err = bt_le_set_chan_map(map);
+		if (err) {
+			LOG_WRN("Failed to set channel map (err %d)", err);	// tried again next period
+		} else {
+			memcpy(chan_map, map, sizeof(map));
+			chan_map_updates++;
+		}
+	}
+
+	k_work_schedule(&chan_map_work, K_MSEC(CONFIG_TTPMS_CHAN_MAP_MS));
+}
+
+static uint8_t TTPMS_chan_used(void)
+{
+	uint8_t used = 0;
+
+	for (int i = 0; i < TTPMS_NUM_CHANNELS; i++) {
+		used += !!(chan_map[i / 8] & BIT(i % 8));
+	}
+
+	return used;
+}
+
+void TTPMS_chan_log_stats(void)
+{
+	LOG_INF("Channel map %02x %02x %02x %02x %02x, %u channels in use, %u updates", chan_map[0], chan_map[1],
+		chan_map[2], chan_map[3], chan_map[4], TTPMS_chan_used(), chan_map_updates);
+}
+
+// Channel map and quality rows of the diagnostics frame (see TTPMS_DIAG_FRAME_ID)
+void TTPMS_chan_diag_row(uint8_t index, uint8_t *data)
+{
+	if (index == 0) {
+		memcpy(&data[1], chan_map, sizeof(chan_map));
+		data[6] = TTPMS_chan_used();
+		data[7] = chan_map_updates;
+		return;
+	}
+
+	for (int i = 0; i < 7; i++) {
+		uint8_t channel = (index - 1) * 7 + i;
+
+		data[1 + i] = (channel < TTPMS_NUM_CHANNELS) ? chan_quality[channel] : TTPMS_CHAN_NO_DATA;
+	}
+}
+
+/* PHY / link quality */
+
+// Links are moved to 2M PHY on connect, which halves the air time of every notification. Every
+// CONFIG_TTPMS_LINK_CHECK_MS the RSSI (HCI Read RSSI) and the CRC error rate (SDC QoS connection event reports) of each
+// link are checked. A marginal link, e.g. a rear sensor behind bodywork, steps down to 1M and then to Coded PHY, and steps
+// back up once it's clean again. Coded uses S2: a notification at S8 takes longer than a connection event.
+
+#define TTPMS_RSSI_2M_MIN		(-80)	// dBm, below this 2M drops to 1M
+#define TTPMS_RSSI_1M_MIN		(-90)	// dBm, below this 1M drops to Coded
+#define TTPMS_RSSI_1M_UP		(-85)	// dBm, above this Coded goes back to 1M
+#define TTPMS_RSSI_2M_UP		(-70)	// dBm, above this 1M goes back to 2M
+#define TTPMS_CRC_DOWN			100		// CRC errors per connection event, 0.1% scale, above this the PHY steps down
+#define TTPMS_CRC_UP			20		// CRC errors per connection event, 0.1% scale, below this the PHY may step up
+#define TTPMS_PHY_HOLD			5		// link checks to stay on a new PHY before changing again
+
+static struct k_work_delayable link_check_work;
+
+static void TTPMS_phy_request(struct TTPMS_sensor *sensor, uint8_t phy)
+{
+	struct bt_conn_le_phy_param param = {
+		.options = (phy == BT_GAP_LE_PHY_CODED) ? BT_CONN_LE_PHY_OPT_CODED_S2 : BT_CONN_LE_PHY_OPT_NONE,
+		.pref_tx_phy = phy,
+		.pref_rx_phy = phy,
+	};
+	struct bt_conn *conn = TTPMS_sensor_conn(sensor);
+	int err;
+
+	if (!conn) {
+		return;	// disconnected since the caller checked
+	}
+
+	err = bt_conn_le_phy_update(conn, &param);
+	bt_conn_unref(conn);
+	if (err) {
+		LOG_WRN("%s: Failed to update PHY (err %d)", sensor->name, err);
+	}
+	sensor->phy_hold = TTPMS_PHY_HOLD;
+}
+
+static int TTPMS_read_rssi(uint16_t handle, int8_t *rssi)
+{
+	struct net_buf *buf, *rsp = NULL;
+	struct bt_hci_cp_read_rssi *cp;
+	struct bt_hci_rp_read_rssi *rp;
+	int err;
+
+	buf = bt_hci_cmd_create(BT_HCI_OP_READ_RSSI, sizeof(*cp));
+	if (!buf) {
+		return -ENOBUFS;
+	}
+
+	cp = net_buf_add(buf, sizeof(*cp));
+	cp->handle = sys_cpu_to_le16(handle);
+
+	err = bt_hci_cmd_send_sync(BT_HCI_OP_READ_RSSI, buf, &rsp);
+	if (err) {
+		return err;
+	}
+
+	rp = (void *)rsp->data;
+	*rssi = rp->rssi;
+	net_buf_unref(rsp);
+
+	return 0;
+}
+
+// Called on connect
+static void TTPMS_phy_connected(struct TTPMS_sensor *sensor, struct bt_conn *conn)
+{
+	bt_hci_get_conn_handle(conn, &sensor->conn_handle);
+	sensor->phy = BT_GAP_LE_PHY_1M;
+	sensor->rssi = 0;	// no reading yet
+	sensor->link_events = atomic_get(&sensor->conn_events);
+	sensor->link_crc_errors = atomic_get(&sensor->crc_errors);
+	sensor->link_samples = atomic_get(&sensor->samples);
+
+	TTPMS_phy_request(sensor, BT_GAP_LE_PHY_2M);
+}
+
+static void TTPMS_link_check_work_handler(struct k_work *work)
+{
+	for (int i = 0; i < TTPMS_NUM_SENSORS; i++) {
+		struct TTPMS_sensor *sensor = &sensors[i];
+		atomic_val_t events = atomic_get(&sensor->conn_events);
+		atomic_val_t crc_errors = atomic_get(&sensor->crc_errors);
+		atomic_val_t samples = atomic_get(&sensor->samples);
+		uint32_t crc_rate = 0;	// 0.1% scale
+		struct bt_conn *conn;
+		uint16_t handle;
+		int8_t rssi;
+		int err;
+
+		sensor->delivered_rate = (samples - sensor->link_samples) * 1000 / CONFIG_TTPMS_LINK_CHECK_MS;
+		sensor->link_samples = samples;
+
+		if (events != sensor->link_events) {
+			crc_rate = (crc_errors - sensor->link_crc_errors) * 1000 / (events - sensor->link_events);
+		}
+		sensor->link_events = events;
+		sensor->link_crc_errors = crc_errors;
+
+		if (sensor->conn_state != TTPMS_CONN_UP) {
+			continue;
+		}
+
+		// our own reference, so the handle stays this link's while we read (see TTPMS_sensor_conn)
+		conn = TTPMS_sensor_conn(sensor);
+		if (!conn) {
+			continue;
+		}
+		err = bt_hci_get_conn_handle(conn, &handle);
+		if (err == 0) {
+			err = TTPMS_read_rssi(handle, &rssi);
+		}
+		bt_conn_unref(conn);
+		if (err) {
+			continue;
+		}
+
+		// average over ~4 checks, the first reading is taken as is
+		sensor->rssi = sensor->rssi ? (3 * sensor->rssi + rssi) / 4 : rssi;
+
+		if (sensor->phy_hold) {
+			sensor->phy_hold--;
+			continue;
+		}
+
+		switch (sensor->phy) {
+		case BT_GAP_LE_PHY_2M:
+			if (sensor->rssi < TTPMS_RSSI_2M_MIN || crc_rate > TTPMS_CRC_DOWN) {
+				LOG_INF("%s: marginal link (%d dBm, %u.%u%% CRC errors), 2M -> 1M", sensor->name, sensor->rssi,
+					crc_rate / 10, crc_rate % 10);
+				TTPMS_phy_request(sensor, BT_GAP_LE_PHY_1M);
+			}
+			break;
+		case BT_GAP_LE_PHY_1M:
+			if (IS_ENABLED(CONFIG_BT_CTLR_PHY_CODED) && (sensor->rssi < TTPMS_RSSI_1M_MIN || crc_rate > TTPMS_CRC_DOWN)) {
+				LOG_INF("%s: marginal link (%d dBm, %u.%u%% CRC errors), 1M -> Coded", sensor->name, sensor->rssi,
+					crc_rate / 10, crc_rate % 10);
+				TTPMS_phy_request(sensor, BT_GAP_LE_PHY_CODED);
+			} else if (sensor->rssi > TTPMS_RSSI_2M_UP && crc_rate < TTPMS_CRC_UP) {
+				TTPMS_phy_request(sensor, BT_GAP_LE_PHY_2M);
+			}
+			break;
+		default:	// Coded
+			if (sensor->rssi > TTPMS_RSSI_1M_UP && crc_rate < TTPMS_CRC_UP) {
+				TTPMS_phy_request(sensor, BT_GAP_LE_PHY_1M);
+			}
+			break;
+		}
+	}
+
+	k_work_schedule(&link_check_work, K_MSEC(CONFIG_TTPMS_LINK_CHECK_MS));
+}
+
+// SDC vendor events, runs in the BT RX thread for every connection event of every link so keep it short
+static bool TTPMS_vs_evt_cb(struct net_buf_simple *buf)
+{
+	const sdc_hci_subevent_vs_qos_conn_event_report_t *evt;
+
+	if (net_buf_simple_pull_u8(buf) != SDC_HCI_SUBEVENT_VS_QOS_CONN_EVENT_REPORT) {
+		return false;
+	}
+
+	evt = (const void *)buf->data;
+
+	for (int i = 0; i < TTPMS_NUM_SENSORS; i++) {
+		if (sensors[i].conn_state == TTPMS_CONN_UP && sensors[i].conn_handle == sys_le16_to_cpu(evt->conn_handle)) {
+			atomic_inc(&sensors[i].conn_events);
+			atomic_add(&sensors[i].crc_errors, evt->crc_error_count);
+			TTPMS_chan_event(evt->channel_index, evt->crc_error_count || !evt->rx_packet_count);
+			break;
+		}
+	}
+
+	return true;
+}
+
+static void TTPMS_qos_reports_enable(void)
+{
+	sdc_hci_cmd_vs_qos_conn_event_report_enable_t *cp;
+	struct net_buf *buf;
+	int err;
+
+	err = bt_hci_register_vnd_evt_cb(TTPMS_vs_evt_cb);
+	if (err) {
+		LOG_WRN("Failed to register vendor event callback (err %d)", err);
+		return;
+	}
+
+	buf = bt_hci_cmd_create(SDC_HCI_OPCODE_CMD_VS_QOS_CONN_EVENT_REPORT_ENABLE, sizeof(*cp));
+	if (!buf) {
+		LOG_WRN("Failed to enable QoS connection event reports (no buffer)");
+		return;
+	}
+
+	cp = net_buf_add(buf, sizeof(*cp));
+	cp->enable = true;
+
+	err = bt_hci_cmd_send_sync(SDC_HCI_OPCODE_CMD_VS_QOS_CONN_EVENT_REPORT_ENABLE, buf, NULL);
+	if (err) {
+		LOG_WRN("Failed to enable QoS connection event reports (err %d)", err);
+	}
+}
+
+static void le_phy_updated(struct bt_conn *conn, struct bt_conn_le_phy_info *param)
+{
+	struct TTPMS_sensor *sensor = conn_sensor[bt_conn_index(conn)];
+
+	if (sensor && sensor->phy != param->tx_phy) {
+		sensor->phy = param->tx_phy;
+		sensor->phy_changes++;
+		LOG_INF("%s: PHY %s", sensor->name, sensor->phy == BT_GAP_LE_PHY_2M ? "2M" :
+			sensor->phy == BT_GAP_LE_PHY_CODED ? "Coded" : "1M");
+	}
+}
+
+/* GATT discovery / handle cache */
+
+// Discovering the TTPMS service takes several round trips per sensor, so the handles are cached in settings per
+// sensor address. On reconnect we only read the sensor's Database Hash: if it matches the cache, the cached handles are
+// used right away, otherwise (sensor firmware changed the GATT table, or no cache yet) the handles are discovered again.
+// The ATT bearer only does one request at a time, so reading the hash first costs no more than subscribing right away
+// and checking the hash alongside. Sensors without a Database Hash (GATT caching disabled) are discovered every time.
+
+#define TTPMS_GATT_CACHE_SUBTREE	"ttpms/gatt"
+#define TTPMS_GATT_CACHE_KEY_LEN	sizeof(TTPMS_GATT_CACHE_SUBTREE "/xxxxxxxxxxxx")
+
+static const struct bt_uuid_128 ttpms_service_uuid = BT_UUID_INIT_128(TTPMS_SERVICE_BASE_UUID);
+static const struct bt_uuid_128 ttpms_batt_uuid = BT_UUID_INIT_128(TTPMS_SERVICE_BATT_UUID);
+static const struct bt_uuid_128 ttpms_temp_uuid = BT_UUID_INIT_128(TTPMS_SERVICE_TEMP_UUID);
+static const struct bt_uuid_128 ttpms_pres_uuid = BT_UUID_INIT_128(TTPMS_SERVICE_PRES_UUID);
+static const struct bt_uuid_128 ttpms_mode_uuid = BT_UUID_INIT_128(TTPMS_SERVICE_MODE_UUID);
+
+
+// settings key of a sensor's cache, "ttpms/gatt/<address>"
+static void TTPMS_gatt_cache_key(const struct TTPMS_sensor *sensor, char *key)
+{
+	const uint8_t *a = sensor->addr.a.val;
+
+	snprintk(key, TTPMS_GATT_CACHE_KEY_LEN, TTPMS_GATT_CACHE_SUBTREE "/%02x%02x%02x%02x%02x%02x",
+		a[5], a[4], a[3], a[2], a[1], a[0]);
+}
+
+static int TTPMS_gatt_cache_set(const char *name, size_t len, settings_read_cb read_cb, void *cb_arg)
+{
+	char key[TTPMS_GATT_CACHE_KEY_LEN];
+
+	for (int i = 0; i < TTPMS_NUM_SENSORS; i++) {
+		TTPMS_gatt_cache_key(&sensors[i], key);
+		if (!settings_name_steq(name, key + sizeof(TTPMS_GATT_CACHE_SUBTREE), NULL)) {
+			continue;
+		}
+		if (len != sizeof(sensors[i].cache)) {
+			LOG_WRN("%s GATT cache has wrong size, ignoring", sensors[i].name);
+			return 0;
+		}
+		if (read_cb(cb_arg, &sensors[i].cache, sizeof(sensors[i].cache)) == sizeof(sensors[i].cache)) {
+			sensors[i].cached = true;
+		}
+		return 0;
+	}
+
+	return 0;	// cache of a sensor that isn't in the table anymore
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(ttpms_gatt, TTPMS_GATT_CACHE_SUBTREE, NULL, TTPMS_gatt_cache_set, NULL, NULL);
+
+// flash writes can take a while, so they're done from the system workqueue instead of the BT RX thread
+static void TTPMS_gatt_cache_save_work_handler(struct k_work *work)
+{
+	struct TTPMS_sensor *sensor = CONTAINER_OF(work, struct TTPMS_sensor, cache_save_work);
+	char key[TTPMS_GATT_CACHE_KEY_LEN];
+	int err;
+
+	TTPMS_gatt_cache_key(sensor, key);
+	err = settings_save_one(key, &sensor->cache, sizeof(sensor->cache));
+	if (err) {
+		LOG_WRN("%s: Failed to save GATT cache (err %d)", sensor->name, err);
+	}
+}
+
+// Point the subscribe params at the handles and start subscribing
+static void TTPMS_gatt_ready(struct TTPMS_sensor *sensor, const struct TTPMS_gatt_cache *handles)
+{
+	sensor->temp_subscribe_params.value_handle = handles->temp_handle;
+	sensor->temp_subscribe_params.ccc_handle = handles->temp_ccc;
+	sensor->pressure_subscribe_params.value_handle = handles->pressure_handle;
+	sensor->pressure_subscribe_params.ccc_handle = handles->pressure_ccc;
+	sensor->mode_handle = handles->mode_handle;
+	sensor->mode = TTPMS_MODE_UNKNOWN;
+
+	sensor->gatt_state = TTPMS_GATT_READY;
+	TTPMS_link_settle(sensor);
+
+	TTPMS_supervisor_kick(sensor->index);	// subscribes right away
+}
+
+static void TTPMS_gatt_discovery_done(struct TTPMS_sensor *sensor)
+{
+	LOG_INF("%s: GATT discovery done, temp 0x%04x (CCC 0x%04x), pressure 0x%04x (CCC 0x%04x)", sensor->name,
+		sensor->found.temp_handle, sensor->found.temp_ccc, sensor->found.pressure_handle, sensor->found.pressure_ccc);
+
+	if (sensor->found.temp_handle == 0 || sensor->found.temp_ccc == 0) {
+		LOG_ERR("%s: no temp characteristic found", sensor->name);
+	}
+
+	// only cache if we can tell later whether it's still right
+	if (sensor->db_hash_ok) {
+		memcpy(sensor->found.db_hash, sensor->db_hash, sizeof(sensor->found.db_hash));
+		sensor->cache = sensor->found;
+		sensor->cached = true;
+		k_work_submit(&sensor->cache_save_work);
+	}
+
+	TTPMS_gatt_ready(sensor, &sensor->found);
+}
+
+static void TTPMS_gatt_discover_next(struct TTPMS_sensor *sensor, struct bt_conn *conn, uint8_t type,
+	const struct bt_uuid *uuid, uint16_t start, uint16_t end);
+
+static uint8_t TTPMS_gatt_discover_cb(struct bt_conn *conn, const struct bt_gatt_attr *attr, struct bt_gatt_discover_params *params)
+{
+	struct TTPMS_sensor *sensor = CONTAINER_OF(params, struct TTPMS_sensor, discover_params);
+
+	switch (params->type) {
+	case BT_GATT_DISCOVER_PRIMARY:
+		if (attr == NULL) {
+			LOG_ERR("%s: TTPMS service not found", sensor->name);
+			TTPMS_gatt_ready(sensor, &sensor->found);	// nothing to subscribe to
+			return BT_GATT_ITER_STOP;
+		}
+
+		sensor->service_end = ((struct bt_gatt_service_val *)attr->user_data)->end_handle;
+		TTPMS_gatt_discover_next(sensor, conn, BT_GATT_DISCOVER_CHARACTERISTIC, NULL, attr->handle + 1, sensor->service_end);
+		return BT_GATT_ITER_STOP;
+
+	case BT_GATT_DISCOVER_CHARACTERISTIC:
+		if (attr == NULL) {
+			uint16_t first = MIN(sensor->found.temp_handle ? sensor->found.temp_handle : UINT16_MAX,
+				sensor->found.pressure_handle ? sensor->found.pressure_handle : UINT16_MAX);
+
+			if (first == UINT16_MAX) {	// none of ours, nothing has a CCC we want
+				TTPMS_gatt_discovery_done(sensor);
+			} else {
+				// CCCs of our characteristics, which come after their value handles
+				TTPMS_gatt_discover_next(sensor, conn, BT_GATT_DISCOVER_DESCRIPTOR, BT_UUID_GATT_CCC,
+					first + 1, sensor->service_end);
+			}
+			return BT_GATT_ITER_STOP;
+		}
+
+		const struct bt_gatt_chrc *chrc = attr->user_data;
+
+		// the previous characteristic of ours ends right before this declaration
+		if (sensor->open_end) {
+			*sensor->open_end = attr->handle - 1;
+			sensor->open_end = NULL;
+		}
+
+		if (!bt_uuid_cmp(chrc->uuid, &ttpms_temp_uuid.uuid)) {
+			sensor->found.temp_handle = chrc->value_handle;
+			sensor->open_end = &sensor->temp_end;
+		} else if (!bt_uuid_cmp(chrc->uuid, &ttpms_pres_uuid.uuid)) {
+			sensor->found.pressure_handle = chrc->value_handle;
+			sensor->open_end = &sensor->pressure_end;
+		} else if (!bt_uuid_cmp(chrc->uuid, &ttpms_batt_uuid.uuid)) {
+			sensor->found.batt_handle = chrc->value_handle;
+		} else if (!bt_uuid_cmp(chrc->uuid, &ttpms_mode_uuid.uuid)) {
+			sensor->found.mode_handle = chrc->value_handle;
+		}
+		return BT_GATT_ITER_CONTINUE;
+
+	default:	// BT_GATT_DISCOVER_DESCRIPTOR
+		if (attr == NULL) {
+			TTPMS_gatt_discovery_done(sensor);
+			return BT_GATT_ITER_STOP;
+		}
+
+		if (sensor->found.temp_handle && attr->handle > sensor->found.temp_handle && attr->handle <= sensor->temp_end) {
+			sensor->found.temp_ccc = attr->handle;
+		} else if (sensor->found.pressure_handle && attr->handle > sensor->found.pressure_handle &&
+			attr->handle <= sensor->pressure_end) {
+			sensor->found.pressure_ccc = attr->handle;
+		}
+		return BT_GATT_ITER_CONTINUE;
+	}
+}
+
+static void TTPMS_gatt_discover_next(struct TTPMS_sensor *sensor, struct bt_conn *conn, uint8_t type,
+	const struct bt_uuid *uuid, uint16_t start, uint16_t end)
+{
+	int err;
+
+	sensor->discover_params.uuid = uuid;
+	sensor->discover_params.func = TTPMS_gatt_discover_cb;
+	sensor->discover_params.start_handle = start;
+	sensor->discover_params.end_handle = end;
+	sensor->discover_params.type = type;
+
+	err = bt_gatt_discover(conn, &sensor->discover_params);
+	if (err) {
+		// without handles this connection is useless, let auto-connect try again
+		LOG_ERR("%s: GATT discovery failed (err %d)", sensor->name, err);
+		bt_conn_disconnect(conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+	}
+}
+
+static void TTPMS_gatt_discover(struct TTPMS_sensor *sensor, struct bt_conn *conn)
+{
+	LOG_INF("%s: discovering GATT handles", sensor->name);
+
+	sensor->gatt_state = TTPMS_GATT_DISCOVERING;
+	TTPMS_link_set(sensor, TTPMS_LINK_DISCOVERING);
+	memset(&sensor->found, 0, sizeof(sensor->found));
+	sensor->temp_end = 0xffff;
+	sensor->pressure_end = 0xffff;
+	sensor->open_end = NULL;
+
+	TTPMS_gatt_discover_next(sensor, conn, BT_GATT_DISCOVER_PRIMARY, &ttpms_service_uuid.uuid,
+		BT_ATT_FIRST_ATTRIBUTE_HANDLE, BT_ATT_LAST_ATTRIBUTE_HANDLE);
+}
+
+static uint8_t TTPMS_gatt_db_hash_cb(struct bt_conn *conn, uint8_t err, struct bt_gatt_read_params *params,
+	const void *data, uint16_t length)
+{
+	struct TTPMS_sensor *sensor = CONTAINER_OF(params, struct TTPMS_sensor, read_params);
+
+	if (!err && data && length == sizeof(sensor->db_hash)) {
+		memcpy(sensor->db_hash, data, sizeof(sensor->db_hash));
+		sensor->db_hash_ok = true;
+	}
+
+	if (sensor->cached && sensor->db_hash_ok && !memcmp(sensor->db_hash, sensor->cache.db_hash, sizeof(sensor->db_hash))) {
+		LOG_INF("%s: using cached GATT handles", sensor->name);
+		TTPMS_gatt_ready(sensor, &sensor->cache);
+	} else {
+		if (sensor->cached) {
+			LOG_INF("%s: GATT database changed", sensor->name);
+		}
+		TTPMS_gatt_discover(sensor, conn);
+	}
+
+	return BT_GATT_ITER_STOP;	// only one hash
+}
+
+// Called on connect, ends with the sensor in TTPMS_GATT_READY (subscribing) one way or another
+static void TTPMS_gatt_start(struct TTPMS_sensor *sensor, struct bt_conn *conn)
+{
+	int err;
+
+	sensor->gatt_state = TTPMS_GATT_HASH;
+	sensor->db_hash_ok = false;
+
+	sensor->read_params.func = TTPMS_gatt_db_hash_cb;
+	sensor->read_params.handle_count = 0;	// read by UUID
+	sensor->read_params.by_uuid.start_handle = BT_ATT_FIRST_ATTRIBUTE_HANDLE;
+	sensor->read_params.by_uuid.end_handle = BT_ATT_LAST_ATTRIBUTE_HANDLE;
+	sensor->read_params.by_uuid.uuid = BT_UUID_GATT_DB_HASH;
+
+	err = bt_gatt_read(conn, &sensor->read_params);
+	if (err) {
+		LOG_WRN("%s: Failed to read GATT Database Hash (err %d)", sensor->name, err);
+		TTPMS_gatt_discover(sensor, conn);
+	}
+}
+
+/* sensor address table */
+
+// Which sensor is at which position is kept in settings ("ttpms/addr/<position>", a bt_addr_le_t), so a sensor can be
+// swapped by sending TTPMS_PROVISION_FRAME_ID instead of reflashing. Positions that were never provisioned start with
+// the address from ttpms_common.h, which is parsed once and saved, so later boots only load the binary table.
+
+#define TTPMS_ADDR_SUBTREE		"ttpms/addr"
+#define TTPMS_ADDR_KEY_LEN		sizeof(TTPMS_ADDR_SUBTREE "/xxx")
+
+static bool addr_loaded[TTPMS_NUM_SENSORS];			// address came from settings
+static bt_addr_le_t addr_provisioned[TTPMS_NUM_SENSORS];	// from CAN, waiting for addr_work
+static atomic_t addr_pending;
+
+static int TTPMS_addr_set(const char *name, size_t len, settings_read_cb read_cb, void *cb_arg)
+{
+	for (int i = 0; i < TTPMS_NUM_SENSORS; i++) {
+		if (!settings_name_steq(name, sensors[i].name, NULL)) {
+			continue;
+		}
+		if (len != sizeof(sensors[i].addr)) {
+			LOG_WRN("%s address has wrong size, ignoring", sensors[i].name);
+			return 0;
+		}
+		if (read_cb(cb_arg, &sensors[i].addr, sizeof(sensors[i].addr)) == sizeof(sensors[i].addr)) {
+			addr_loaded[i] = true;
+		}
+		return 0;
+	}
+
+	return 0;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(ttpms_addr, TTPMS_ADDR_SUBTREE, NULL, TTPMS_addr_set, NULL, NULL);
+
+static void TTPMS_addr_save(const struct TTPMS_sensor *sensor)
+{
+	char key[TTPMS_ADDR_KEY_LEN];
+	int err;
+
+	snprintk(key, sizeof(key), TTPMS_ADDR_SUBTREE "/%s", sensor->name);
+	err = settings_save_one(key, &sensor->addr, sizeof(sensor->addr));
+	if (err) {
+		LOG_WRN("%s: Failed to save address (err %d)", sensor->name, err);
+	}
+}
+
+// Addresses from settings (or ttpms_common.h) and the filter accept list, at boot
+static void TTPMS_addr_load(bool settings_ok)
+{
+	char addr_str[BT_ADDR_LE_STR_LEN];
+	int err;
+
+	if (settings_ok) {
+		settings_load_subtree(TTPMS_ADDR_SUBTREE);
+	}
+
+	for (int i = 0; i < TTPMS_NUM_SENSORS; i++) {
+		struct TTPMS_sensor *sensor = &sensors[i];
+
+		if (!addr_loaded[i]) {
+			err = bt_addr_le_from_str(sensor->bt_id, "random", &sensor->addr);
+			if (err) {
+				LOG_WRN("%s: Invalid BT address (err %d)", sensor->name, err);
+			} else if (settings_ok) {
+				TTPMS_addr_save(sensor);
+			}
+		}
+
+		// Add address of the devices we want to filter accept list
+		err = bt_le_filter_accept_list_add(&sensor->addr);
+		if (err) {
+			LOG_WRN("Failed to add address to filter accept list (err %d)", err);
+		}
+
+		bt_addr_le_to_str(&sensor->addr, addr_str, sizeof(addr_str));
+		LOG_INF("%s: %s%s", sensor->name, addr_str, addr_loaded[i] ? "" : " (from ttpms_common.h)");
+	}
+}
+
+// Put a new address in place: swap the accept list entry, forget the old GATT cache. The old sensor must be
+// disconnected already, so nothing is using the old address.
+static void TTPMS_addr_replace(struct TTPMS_sensor *sensor, const bt_addr_le_t *addr)
+{
+	char key[TTPMS_GATT_CACHE_KEY_LEN];
+	char addr_str[BT_ADDR_LE_STR_LEN];
+	k_spinlock_key_t lock_key;
+	int err;
+
+	bt_le_filter_accept_list_remove(&sensor->addr);
+
+	TTPMS_gatt_cache_key(sensor, key);
+	settings_delete(key);
+	sensor->cached = false;
+
+	lock_key = k_spin_lock(&addr_lock);
+	sensor->addr = *addr;
+	k_spin_unlock(&addr_lock, lock_key);
+	addr_loaded[sensor->index] = true;
+
+	err = bt_le_filter_accept_list_add(&sensor->addr);
+	if (err) {
+		LOG_WRN("Failed to add address to filter accept list (err %d)", err);
+	}
+	TTPMS_addr_save(sensor);
+
+	bt_addr_le_to_str(&sensor->addr, addr_str, sizeof(addr_str));
+	LOG_INF("%s: now %s", sensor->name, addr_str);
+}
+
+static void TTPMS_addr_work_handler(struct k_work *work)
+{
+	atomic_val_t pending = atomic_clear(&addr_pending);
+	int err;
+
+	// the accept list can't change while auto-connect is using it, conn_mgr_work starts it again
+	if (atomic_get(&conn_mgr_scanning)) {
+		err = bt_conn_create_auto_stop();
+		if (err) {
+			LOG_ERR("Failed to stop automatically connecting (err %d)", err);
+		}
+		atomic_set(&conn_mgr_scanning, 0);
+		atomic_set(&conn_mgr_scan_duty, 0);
+	}
+
+	for (int i = 0; i < TTPMS_NUM_SENSORS; i++) {
+		struct TTPMS_sensor *sensor = &sensors[i];
+		bt_addr_le_t addr = addr_provisioned[i];
+		bool used = false;
+
+		if (!(pending & BIT(i))) {
+			continue;
+		}
+
+		if (!bt_addr_cmp(&addr.a, BT_ADDR_ANY) && bt_addr_le_from_str(sensor->bt_id, "random", &addr)) {
+			continue;
+		}
+
+		if (bt_addr_le_eq(&addr, &sensor->addr)) {
+			continue;
+		}
+
+		for (int j = 0; j < TTPMS_NUM_SENSORS; j++) {
+			if (j != i && bt_addr_le_eq(&addr, &sensors[j].addr)) {
+				LOG_WRN("%s: address is already used by %s, ignoring", sensor->name, sensors[j].name);
+				used = true;
+			}
+		}
+		if (used) {
+			continue;
+		}
+
+		// swap only once the old sensor is gone, disconnected() submits us again
+		struct bt_conn *conn = TTPMS_sensor_conn(sensor);
+
+		if (conn) {
+			err = bt_conn_disconnect(conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+			bt_conn_unref(conn);
+			if (err && err != -ENOTCONN) {	// -ENOTCONN: already going down, disconnected() is on its way
+				LOG_WRN("%s: Failed to disconnect for the new address (err %d), ignoring", sensor->name, err);
+				continue;
+			}
+			atomic_set_bit(&addr_pending, i);
+			continue;
+		}
+
+		TTPMS_addr_replace(sensor, &addr);
+	}
+
+	// keep auto-connect off while a swap waits for a disconnect, it would bring the old sensor straight back
+	if (atomic_get(&addr_pending)) {
+		atomic_set(&conn_mgr_hold, 1);
+	} else {
+		atomic_set(&conn_mgr_hold, 0);
+		k_work_reschedule(&conn_mgr_work, K_NO_WAIT);
+	}
+}
+
+static K_WORK_DEFINE(addr_work, TTPMS_addr_work_handler);
+
+// Called from the CAN RX callback with the position and the 6 address bytes of TTPMS_PROVISION_FRAME_ID
+void TTPMS_BLE_provision(uint8_t position, const uint8_t *addr)
+{
+	if (position >= TTPMS_NUM_POSITIONS || position_sensor[position] == TTPMS_NOT_FITTED) {
+		LOG_WRN("Provisioning frame for unknown position %u", position);
+		return;
+	}
+
+	uint8_t index = position_sensor[position];
+
+	addr_provisioned[index].type = BT_ADDR_LE_RANDOM;
+	memcpy(addr_provisioned[index].a.val, addr, sizeof(addr_provisioned[index].a.val));
+	atomic_set_bit(&addr_pending, index);
+	k_work_submit(&addr_work);
+}
+
+// here we set the connected bit for the sensor that connected (self-explanatory)
+static void connected(struct bt_conn *conn, uint8_t err)
+{
+	char addr_str[BT_ADDR_LE_STR_LEN];
+
+	const bt_addr_le_t *addr = bt_conn_get_dst(conn);
+
+	bt_addr_le_to_str(addr, addr_str, sizeof(addr_str));
+
+	atomic_set(&conn_mgr_scanning, 0);	// auto-connect is done either way
+	atomic_set(&conn_mgr_scan_duty, 0);
+
+	if (err) {
+		LOG_WRN("Failed to connect to %s (%u)", addr_str, err);
+	} else {
+
+		// the only address compare, everything after this finds the sensor from the connection index
+		struct TTPMS_sensor *sensor = sensor_from_addr(addr);
+
+		if (sensor) {
+
+			if(atomic_test_and_set_bit(flags, CONNECTED_FLAG(sensor->position))) {
+				LOG_WRN("WARNING, DUPLICATE CONNECTION:");
+			} else {
+				k_spinlock_key_t key = k_spin_lock(&conn_lock);
+
+				sensor->conn = bt_conn_ref(conn);
+				k_spin_unlock(&conn_lock, key);
+				conn_sensor[bt_conn_index(conn)] = sensor;
+				LOG_INF("%s connected, addr: %s", sensor->name, addr_str);
+				sensor->connected_at = MAX(k_uptime_get_32(), 1);
+				TTPMS_link_set(sensor, TTPMS_LINK_CONNECTED);
+				TTPMS_conn_mgr_connected(sensor);
+				TTPMS_conn_param_connected(sensor, conn);
+				TTPMS_phy_connected(sensor, conn);
+				TTPMS_gatt_start(sensor, conn);
+			}
+
+		} else {
+			LOG_INF("Unrecognized device connected, addr: %s", addr_str);
+		}
+
+	}
+
+
+	k_work_reschedule(&conn_mgr_work, K_NO_WAIT);	// restart auto-connect, with scan parameters for what's still missing
+}
+
+// Here we clear the connected bit for the sensor that disconnected (self-explanatory),
+// and we also clear the subscribe bit so that the logic in main will know we need to
+// subscribe again if re-connected (although there is also be a callback indicating the unsubscribe event upon disconnect).
+static void disconnected(struct bt_conn *conn, uint8_t reason)
+{
+	char addr_str[BT_ADDR_LE_STR_LEN];
 
-			if(atomic_test_and_set_bit(flags, IRR_CONNECTED_FLAG)) {
-				LOG_WRN("WARNING, DUPLICATE CONNECTION:");
-			}
-			LOG_INF("Internal RR connected, addr: %s", addr_str);
-			
-		} else if (bt_addr_le_eq(addr, &EFL_bt_addr)) {
+	struct TTPMS_sensor *sensor = conn_sensor[bt_conn_index(conn)];
 
-			if(atomic_test_and_set_bit(flags, EFL_CONNECTED_FLAG)) {
-				LOG_WRN("WARNING, DUPLICATE CONNECTION:");
-			}
-			LOG_INF("External FL connected, addr: %s", addr_str);
+	bt_addr_le_to_str(bt_conn_get_dst(conn), addr_str, sizeof(addr_str));
 
-		} else if (bt_addr_le_eq(addr, &EFR_bt_addr)) {
+	if (sensor && sensor->conn == conn) {
 
-			if(atomic_test_and_set_bit(flags, EFR_CONNECTED_FLAG)) {
-				LOG_WRN("WARNING, DUPLICATE CONNECTION:");
-			}
-			LOG_INF("External FR connected, addr: %s", addr_str);
+		k_spinlock_key_t key = k_spin_lock(&conn_lock);
 
-		} else if (bt_addr_le_eq(addr, &ERL_bt_addr)) {
+		sensor->conn = NULL;
+		k_spin_unlock(&conn_lock, key);
 
-			if(atomic_test_and_set_bit(flags, ERL_CONNECTED_FLAG)) {
-				LOG_WRN("WARNING, DUPLICATE CONNECTION:");
-			}
-			LOG_INF("External RL connected, addr: %s", addr_str);
-			
-		} else if (bt_addr_le_eq(addr, &ERR_bt_addr)) {
+		conn_sensor[bt_conn_index(conn)] = NULL;
+		sensor->gatt_state = TTPMS_GATT_UNKNOWN;
+		bt_conn_unref(conn);
 
-			if(atomic_test_and_set_bit(flags, ERR_CONNECTED_FLAG)) {
-				LOG_WRN("WARNING, DUPLICATE CONNECTION:");
-			}
-			LOG_INF("External RR connected, addr: %s", addr_str);
-			
-		} else {
-			LOG_INF("Unrecognized device connected, addr: %s", addr_str);
+		atomic_clear_bit(flags, CONNECTED_FLAG(sensor->position));
+		atomic_clear_bit(flags, SUBSCRIBED_FLAG(sensor->index));
+		if (sensor->pressure_frame_id) {
+			atomic_clear_bit(flags, PRES_SUBSCRIBED_FLAG(sensor->index));
+		}
+		atomic_clear(&sensor->streams);
+		sensor->connected_at = 0;
+		TTPMS_link_set(sensor, TTPMS_LINK_IDLE);	// scanning again once auto-connect restarts
+		LOG_INF("%s disconnected, addr: %s (reason 0x%02x)", sensor->name, addr_str, reason);
+		TTPMS_conn_mgr_disconnected(sensor);
+		TTPMS_supervisor_kick(sensor->index);	// drops its retry state
+
+		if (atomic_test_bit(&addr_pending, sensor->index)) {
+			k_work_submit(&addr_work);	// new address was waiting for this disconnect
 		}
 
+	} else {
+		LOG_INF("Unknown device disconnected, addr: %s (reason 0x%02x)", addr_str, reason);
 	}
 
 
-	// NOTE: there's gotta be a way to have the BT thread prioritize notifications over scanning. below is kinda dumb
-
-	// if all the sensors we care about are connected, use slow scanning so that BT thread is used mainly for TTPMS throughput
-	// if we still want to find more sensors, use fast scanning to get them connected quick
-	if (atomic_test_bit(flags, EFL_CONNECTED_FLAG) && atomic_test_bit(flags, EFR_CONNECTED_FLAG) && atomic_test_bit(flags, ERL_CONNECTED_FLAG) && atomic_test_bit(flags, ERR_CONNECTED_FLAG)) {
+	k_work_reschedule(&conn_mgr_work, K_NO_WAIT);	// lost sensor gets fast scanning (fitted around the remaining links)
+}
 
-		scan_param.interval = BT_GAP_SCAN_SLOW_INTERVAL_1;
-		scan_param.window = BT_GAP_SCAN_SLOW_WINDOW_1;
-		err = bt_conn_le_create_auto(&scan_param, &conn_param);
-		if (err) {
-			LOG_ERR("Failed to start automatically connecting (err %d)", err);
-		}
+BT_CONN_CB_DEFINE(conn_callbacks) = {
+	.connected = connected,
+	.disconnected = disconnected,
+	.le_param_req = le_param_req,
+	.le_param_updated = le_param_updated,
+	.le_phy_updated = le_phy_updated,
+};
 
-	} else {
+// Whether a sensor's temp characteristic should be subscribed
+static bool TTPMS_BLE_want_temp(const struct TTPMS_sensor *sensor)
+{
+	return atomic_test_bit(flags, TEMP_ENABLED_FLAG) ||
+		(TTPMS_COMBINED(sensor) && atomic_test_bit(flags, PRESSURE_ENABLED_FLAG));
+}
 
-		scan_param.interval = BT_GAP_SCAN_FAST_INTERVAL;
-		scan_param.window = BT_GAP_SCAN_FAST_WINDOW;
-		err = bt_conn_le_create_auto(&scan_param, &conn_param);
-		if (err) {
-			LOG_ERR("Failed to start automatically connecting (err %d)", err);
-		}
+// Decode a pressure reading and queue it for CAN
+static void TTPMS_BLE_publish_pressure(struct TTPMS_sensor *sensor, const uint8_t *data, uint32_t release)
+{
+	uint8_t frame[TTPMS_PRESSURE_LEN];
 
+	if (!atomic_test_bit(flags, PRESSURE_ENABLED_FLAG)) {
+		return;
 	}
 
-	
+	sensor->pressure = sys_get_le24(data);
+	atomic_inc(&sensor->pressure_notifications);
 
+	sys_put_le24(sensor->pressure, frame);
+	TTPMS_CAN_queue_sample_at(TTPMS_PRESSURE_SOURCE(sensor->index), sensor->pressure_frame_id, frame, sizeof(frame), release);
 }
 
-// Here we clear the connected bit for the sensor that disconnected (self-explanatory),
-// and we also clear the subscribe bit so that the logic in main will know we need to
-// subscribe again if re-connected (although there is also be a callback indicating the unsubscribe event upon disconnect).
-static void disconnected(struct bt_conn *conn, uint8_t reason)
+// One temp sample (with pressure in combined mode), to be sent on CAN at release
+static void TTPMS_BLE_publish_temp(struct TTPMS_sensor *sensor, const uint8_t *data, uint8_t length, uint32_t release)
 {
-	int err;
+	// combined notifications carry the pressure after the temp pixels
+	if (length == sensor->temp_len + TTPMS_PRESSURE_LEN) {
+		TTPMS_BLE_publish_pressure(sensor, data + sensor->temp_len, release);
+	}
 
-	char addr_str[BT_ADDR_LE_STR_LEN];
+	atomic_inc(&sensor->samples);
 
-	const bt_addr_le_t *addr = bt_conn_get_dst(conn);
+	if (atomic_test_bit(flags, TEMP_ENABLED_FLAG)) {
+		TTPMS_CAN_queue_sample_at(sensor->index, sensor->temp_frame_id, data, sensor->temp_len, release);
+	}
+}
 
-	bt_addr_le_to_str(addr, addr_str, sizeof(addr_str));
+/* notification hand-off */
+
+// The notify callbacks run in the BT RX thread, so anything slow there holds up ACL processing of all links. They only
+// copy the payload into a single-producer/single-consumer ring (the BT RX thread is the only producer, the notification
+// thread the only consumer, so no locks are needed) and wake the notification thread, which does the decoding, batch
+// unpacking and CAN queuing. The payload has to be copied once, the notify callback doesn't get to keep the ACL buffer.
+
+#define TTPMS_NOTIFY_TEMP		0
+#define TTPMS_NOTIFY_PRESSURE	1
+
+#define TTPMS_NOTIFY_MAX_LEN	(BT_L2CAP_RX_MTU - 3)	// what we receive: L2CAP RX MTU (ACL RX buffer - L2CAP header) - ATT header
+
+// Most samples accepted in one temp notification with this sample length: CONFIG_TTPMS_BATCH_MAX, or fewer if that many
+// (with their timestamps and a sequence trailer) wouldn't fit in a notification we can receive
+#define TTPMS_BATCH_FIT(sample_len)	\
+	MIN(CONFIG_TTPMS_BATCH_MAX, (TTPMS_NOTIFY_MAX_LEN - TTPMS_SEQ_LEN) / (TTPMS_BATCH_TS_LEN + (sample_len)))
+
+// The largest temp notification we accept (a full batch with trailer) fits a ring slot, and a batch of at least one does
+#define TTPMS_NOTIFY_FITS(sample_len)	\
+	(TTPMS_BATCH_FIT(sample_len) >= 1 &&	\
+	 TTPMS_BATCH_FIT(sample_len) * (TTPMS_BATCH_TS_LEN + (sample_len)) + TTPMS_SEQ_LEN <= TTPMS_NOTIFY_MAX_LEN)
+
+BUILD_ASSERT(TTPMS_NOTIFY_FITS(CONFIG_TTPMS_INTERNAL_PIXELS +
+	(IS_ENABLED(CONFIG_TTPMS_COMBINED_TEMP_PRESSURE) ? TTPMS_PRESSURE_LEN : 0)),
+	"internal sensor notifications don't fit CONFIG_BT_BUF_ACL_RX_SIZE");
+BUILD_ASSERT(TTPMS_NOTIFY_FITS(CONFIG_TTPMS_EXTERNAL_FRONT_PIXELS),
+	"external front sensor notifications don't fit CONFIG_BT_BUF_ACL_RX_SIZE");
+BUILD_ASSERT(TTPMS_NOTIFY_FITS(CONFIG_TTPMS_EXTERNAL_REAR_PIXELS),
+	"external rear sensor notifications don't fit CONFIG_BT_BUF_ACL_RX_SIZE");
+
+BUILD_ASSERT(IS_POWER_OF_TWO(CONFIG_TTPMS_NOTIFY_RING_DEPTH), "ring depth must be a power of two");
+
+struct TTPMS_notify {
+	uint32_t arrival;		// k_uptime_get_32()
+	uint8_t sensor;
+	uint8_t kind;			// TTPMS_NOTIFY_*
+	uint8_t conn_gen;		// the sensor's conn_gen when it arrived
+	uint16_t length;		// as received, may be more than was copied (then it's invalid anyway)
+	uint8_t data[TTPMS_NOTIFY_MAX_LEN];
+};
 
-	if (bt_addr_le_eq(addr, &IFL_bt_addr)) {
+static struct TTPMS_notify notify_ring[CONFIG_TTPMS_NOTIFY_RING_DEPTH];
+static atomic_t notify_head;		// only written by the BT RX thread
+static atomic_t notify_tail;		// only written by the notification thread
+static atomic_t notify_drops;		// ring was full
+static atomic_t notify_hwm;			// most entries in the ring at once
+static atomic_t notify_cb_max_cycles;	// longest time spent in a notify callback
+static K_SEM_DEFINE(notify_sem, 0, 1);
 
-		atomic_clear_bit(flags, IFL_CONNECTED_FLAG);
-		atomic_clear_bit(flags, IFL_SUBSCRIBED_FLAG);
-		LOG_INF("Internal FL disconnected, addr: %s (reason 0x%02x)", addr_str, reason);
+// Constant time, called from the notify callbacks only
+static void TTPMS_notify_put(uint8_t sensor, uint8_t kind, const void *data, uint16_t length)
+{
+	atomic_val_t head = atomic_get(&notify_head);
+	atomic_val_t depth = head - atomic_get(&notify_tail);
+	struct TTPMS_notify *n;
 
-	} else if (bt_addr_le_eq(addr, &IFR_bt_addr)) {
+	if (depth >= CONFIG_TTPMS_NOTIFY_RING_DEPTH) {
+		atomic_inc(&notify_drops);
+		return;
+	}
+	if (depth + 1 > atomic_get(&notify_hwm)) {
+		atomic_set(&notify_hwm, depth + 1);
+	}
 
-		atomic_clear_bit(flags, IFR_CONNECTED_FLAG);
-		atomic_clear_bit(flags, IFR_SUBSCRIBED_FLAG);
-		LOG_INF("Internal FR disconnected, addr: %s (reason 0x%02x)", addr_str, reason);
+	n = &notify_ring[head & (CONFIG_TTPMS_NOTIFY_RING_DEPTH - 1)];
+	n->arrival = k_uptime_get_32();
+	n->sensor = sensor;
+	n->kind = kind;
+	n->conn_gen = sensors[sensor].conn_gen;	// same thread as connected(), no race
+	n->length = length;
+	memcpy(n->data, data, MIN(length, sizeof(n->data)));
 
-	} else if (bt_addr_le_eq(addr, &IRL_bt_addr)) {
+	atomic_set(&notify_head, head + 1);	// publishes the entry, atomic_set is a full barrier
+	k_sem_give(&notify_sem);
+}
 
-		atomic_clear_bit(flags, IRL_CONNECTED_FLAG);
-		atomic_clear_bit(flags, IRL_SUBSCRIBED_FLAG);
-		LOG_INF("Internal RL disconnected, addr: %s (reason 0x%02x)", addr_str, reason);
-		
-	} else if (bt_addr_le_eq(addr, &IRR_bt_addr)) {
+static void TTPMS_notify_cb_time(uint32_t start)
+{
+	uint32_t cycles = k_cycle_get_32() - start;
 
-		atomic_clear_bit(flags, IRR_CONNECTED_FLAG);
-		atomic_clear_bit(flags, IRR_SUBSCRIBED_FLAG);
-		LOG_INF("Internal RR disconnected, addr: %s (reason 0x%02x)", addr_str, reason);
-		
-	} else if (bt_addr_le_eq(addr, &EFL_bt_addr)) {
+	if (cycles > atomic_get(&notify_cb_max_cycles)) {	// only the BT RX thread writes this
+		atomic_set(&notify_cb_max_cycles, cycles);
+	}
+}
 
-		atomic_clear_bit(flags, EFL_CONNECTED_FLAG);
-		atomic_clear_bit(flags, EFL_SUBSCRIBED_FLAG);
-		LOG_INF("External FL disconnected, addr: %s (reason 0x%02x)", addr_str, reason);
+// The notify callbacks don't log themselves, they leave a bit for main. Repeats before main gets to it are merged, so
+// a sensor that keeps notifying while its unsubscribe is under way logs once per pass of main instead of every time.
+static void TTPMS_notify_log(struct TTPMS_sensor *sensor, int bit)
+{
+	if (!atomic_test_and_set_bit(&sensor->notify_log, bit)) {
+		TTPMS_supervisor_post(TTPMS_EVT_NOTIFY_LOG);
+	}
+}
 
-	} else if (bt_addr_le_eq(addr, &EFR_bt_addr)) {
+static void TTPMS_notify_log_flush(void)
+{
+	static const char *const what[TTPMS_NOTIFY_LOG_COUNT] = {
+		[TTPMS_NOTIFY_LOG_TEMP_UNSUBSCRIBED] = "temp_notify_cb: unsubscribed",
+		[TTPMS_NOTIFY_LOG_TEMP_UNSUBSCRIBING] = "temp_notify_cb: attempting to unsubscribe",
+		[TTPMS_NOTIFY_LOG_PRES_UNSUBSCRIBED] = "pressure_notify_cb: unsubscribed",
+		[TTPMS_NOTIFY_LOG_PRES_UNSUBSCRIBING] = "pressure_notify_cb: attempting to unsubscribe",
+	};
 
-		atomic_clear_bit(flags, EFR_CONNECTED_FLAG);
-		atomic_clear_bit(flags, EFR_SUBSCRIBED_FLAG);
-		LOG_INF("External FR disconnected, addr: %s (reason 0x%02x)", addr_str, reason);
+	for (int i = 0; i < TTPMS_NUM_SENSORS; i++) {
+		atomic_val_t log = atomic_clear(&sensors[i].notify_log);
 
-	} else if (bt_addr_le_eq(addr, &ERL_bt_addr)) {
+		for (int bit = 0; bit < TTPMS_NOTIFY_LOG_COUNT; bit++) {
+			if (log & BIT(bit)) {
+				LOG_INF("%s %s", sensors[i].name, what[bit]);
+			}
+		}
+	}
+}
 
-		atomic_clear_bit(flags, ERL_CONNECTED_FLAG);
-		atomic_clear_bit(flags, ERL_SUBSCRIBED_FLAG);
-		LOG_INF("External RL disconnected, addr: %s (reason 0x%02x)", addr_str, reason);
-		
-	} else if (bt_addr_le_eq(addr, &ERR_bt_addr)) {
+// Samples in a temp notification of this length (without trailer), 0 if the length is invalid
+static uint16_t TTPMS_BLE_temp_samples(const struct TTPMS_sensor *sensor, uint16_t length)
+{
+	uint8_t sample_len = sensor->temp_len + (TTPMS_COMBINED(sensor) ? TTPMS_PRESSURE_LEN : 0);
+	uint8_t stride = TTPMS_BATCH_TS_LEN + sample_len;
 
-		atomic_clear_bit(flags, ERR_CONNECTED_FLAG);
-		atomic_clear_bit(flags, ERR_SUBSCRIBED_FLAG);
-		LOG_INF("External RR disconnected, addr: %s (reason 0x%02x)", addr_str, reason);
-		
-	} else {
-		LOG_INF("Unknown device disconnected, addr: %s (reason 0x%02x)", addr_str, reason);
+	if (length == sensor->temp_len || length == sample_len) {
+		return 1;
+	}
+	if (length % stride == 0 && length / stride <= TTPMS_BATCH_FIT(sample_len)) {
+		return length / stride;
 	}
+	return 0;
+}
 
+// Loss, order and jitter from the sequence trailer of a notification carrying count samples that arrived at now
+static void TTPMS_BLE_track_seq(struct TTPMS_sensor *sensor, const uint8_t *trailer, uint16_t count, uint32_t now)
+{
+	uint16_t seq = sys_get_le16(trailer);
+	uint16_t sensor_ms = sys_get_le16(trailer + 2);
+	int16_t ahead = seq - sensor->seq;	// wraps
 
-	// see note in connected(), it would be nice to remove the below if the BT thread can be made to prioritize notifications over scanning
-	// if we lost a sensor we want to have, stop slow scanning and start fast scanning to get it connected again quickly
-	if (!(atomic_test_bit(flags, EFL_CONNECTED_FLAG) && atomic_test_bit(flags, EFR_CONNECTED_FLAG) && atomic_test_bit(flags, ERL_CONNECTED_FLAG) && atomic_test_bit(flags, ERR_CONNECTED_FLAG))) {
+	if (sensor->seq_valid && ahead <= 0) {
+		sensor->seq_out_of_order += count;
+		return;
+	}
 
-		err = bt_conn_create_auto_stop();
-		if (err) {
-			LOG_ERR("Failed to stop automatically connecting (err %d)", err);
-		}
+	if (sensor->seq_valid) {
+		// RFC 3550 interarrival jitter: the change in transit time between notifications, smoothed over 16
+		int32_t d = (int32_t)(now - sensor->seq_arrival) - (uint16_t)(sensor_ms - sensor->sensor_ms);
+		uint32_t d_16 = ((d < 0) ? -d : d) * 16;
 
-		scan_param.interval = BT_GAP_SCAN_FAST_INTERVAL;
-		scan_param.window = BT_GAP_SCAN_FAST_WINDOW;
-		err = bt_conn_le_create_auto(&scan_param, &conn_param);
-		if (err) {
-			LOG_ERR("Failed to start automatically connecting (err %d)", err);
+		if (ahead > count) {
+			sensor->seq_lost += ahead - count;
+			sensor->seq_gaps++;
 		}
-
+		sensor->jitter = (d_16 > sensor->jitter) ? sensor->jitter + (d_16 - sensor->jitter) / 16
+			: sensor->jitter - (sensor->jitter - d_16) / 16;
 	}
 
+	sensor->seq_valid = true;
+	sensor->seq = seq;
+	sensor->sensor_ms = sensor_ms;
+	sensor->seq_arrival = now;
 }
 
-BT_CONN_CB_DEFINE(conn_callbacks) = {
-	.connected = connected,
-	.disconnected = disconnected,
-};
-
-void IFL_temp_subscribed_cb(struct bt_conn *conn, uint8_t err, struct bt_gatt_subscribe_params *params)
+static void TTPMS_BLE_process_temp(struct TTPMS_sensor *sensor, const uint8_t *data, uint16_t length, uint32_t now)
 {
-	if(params->value == BT_GATT_CCC_NOTIFY) {
+	uint8_t sample_len = sensor->temp_len + (TTPMS_COMBINED(sensor) ? TTPMS_PRESSURE_LEN : 0);
+	uint8_t stride = TTPMS_BATCH_TS_LEN + sample_len;
+	uint16_t count = TTPMS_BLE_temp_samples(sensor, length);
+
+	if (count == 0 && length > TTPMS_SEQ_LEN) {
+		count = TTPMS_BLE_temp_samples(sensor, length - TTPMS_SEQ_LEN);
+		if (count) {
+			length -= TTPMS_SEQ_LEN;
+			TTPMS_BLE_track_seq(sensor, data + length, count, now);
+		}
+	}
 
-		atomic_set_bit(flags, IFL_SUBSCRIBED_FLAG);
-		LOG_INF("IFL_temp_subscribed_cb: subscribed");
+	if (count == 0) {
+		atomic_inc(&sensor->invalid);
+		LOG_ERR("%s: Invalid temp notification (%u bytes)", sensor->name, length);
+		return;
+	}
 
-	} else if (params->value == 0) {
+	if (length == sensor->temp_len || length == sample_len) {
 
-		atomic_clear_bit(flags, IFL_SUBSCRIBED_FLAG);
-		LOG_INF("IFL_temp_subscribed_cb: unsubscribed");
+		// one sample, goes out right away
+		TTPMS_BLE_publish_temp(sensor, data, length, now);
 
 	} else {
-		LOG_WRN("IFL_temp_subscribed_cb: unknown CCC value");
+
+		// batch of samples, the last one is the newest: send the first right away and the rest at their original spacing
+		const uint8_t *sample = data;
+		uint16_t first_ms = sys_get_le16(sample);
+
+		for (int i = 0; i < count; i++, sample += stride) {
+			uint16_t offset_ms = sys_get_le16(sample) - first_ms;	// sensor ms, wraps
+
+			TTPMS_BLE_publish_temp(sensor, sample + TTPMS_BATCH_TS_LEN, sample_len,
+				now + MIN(offset_ms, TTPMS_BATCH_SPAN_MAX_MS));
+		}
 	}
+
+	atomic_inc(&sensor->notifications);
+	TTPMS_link_data(sensor, now);
 }
 
-uint8_t IFL_temp_notify_cb(struct bt_conn *conn, struct bt_gatt_subscribe_params *params, const void *data, uint16_t length)
+static void TTPMS_BLE_process_pressure(struct TTPMS_sensor *sensor, const uint8_t *data, uint16_t length, uint32_t now)
 {
-	
-	if (data == NULL){	// When successfully unsubscribed, (or if unpurposefully unsubscribed?), notify callback is called one last time with data set to NULL (from Zephyr docs)
-		LOG_INF("IFL_temp_notify_cb: unsubscribed");
-		atomic_clear_bit(flags, IFL_SUBSCRIBED_FLAG);
-		return BT_GATT_ITER_STOP;
+	if (length != TTPMS_PRESSURE_LEN) {
+		atomic_inc(&sensor->invalid);
+		LOG_ERR("%s: Invalid pressure notification (%u bytes)", sensor->name, length);
+		return;
 	}
 
-	if (!atomic_test_bit(flags, TEMP_ENABLED_FLAG)) {	// if temp is not enabled, we need to unsubscribe
-		LOG_INF("IFL_temp_notify_cb: attempting to unsubscribe");
-		return BT_GATT_ITER_STOP;	// returning this tells the BT Host to unsubscribe us
-	}
+	TTPMS_BLE_publish_pressure(sensor, data, now);
+	TTPMS_link_data(sensor, now);
+}
 
-	if (length != 16) {
-		LOG_ERR("IFL_temp_notify_cb: Invalid data received from notification");
-		return BT_GATT_ITER_CONTINUE;
-	}
-	
-	//LOG_INF("IFL_temp_notify_cb: Notification received");
+void TTPMS_notify_thread(void *p1, void *p2, void *p3)
+{
+	while (1) {
 
-	// fill CAN frames with data
-	for (int i = 0; i < 8; i++)
-	{
-		IFL_temp_1.data[i] = ((uint8_t *)data)[i];
-	}
-	for (int i = 0; i < 8; i++)
-	{
-		IFL_temp_2.data[i] = ((uint8_t *)data)[8 + i];
-	}
+		k_sem_take(&notify_sem, K_FOREVER);
 
-	// let the system workqueue actually send the frames (can_send is blocking)
-	k_work_submit(&IFL_temp_CAN_tx_work);
+		while (atomic_get(&notify_tail) != atomic_get(&notify_head)) {
+			atomic_val_t tail = atomic_get(&notify_tail);
+			struct TTPMS_notify *n = &notify_ring[tail & (CONFIG_TTPMS_NOTIFY_RING_DEPTH - 1)];
+			struct TTPMS_sensor *sensor = &sensors[n->sensor];
 
-	return BT_GATT_ITER_CONTINUE;	// stay subscribed
+			// first notification of a new connection, the sensor may have restarted its sequence
+			if (n->conn_gen != sensor->seq_gen) {
+				sensor->seq_gen = n->conn_gen;
+				sensor->seq_valid = false;
+			}
+
+			if (n->kind == TTPMS_NOTIFY_TEMP) {
+				TTPMS_BLE_process_temp(sensor, n->data, n->length, n->arrival);
+			} else {
+				TTPMS_BLE_process_pressure(sensor, n->data, n->length, n->arrival);
+			}
+
+			atomic_set(&notify_tail, tail + 1);	// hands the entry back to the producer
+		}
+	}
 }
 
-static struct bt_gatt_subscribe_params IFL_temp_subscribe_params = {
-		.value = BT_GATT_CCC_NOTIFY,
-		.notify = IFL_temp_notify_cb,
-		.subscribe = IFL_temp_subscribed_cb,
-		.value_handle = TTPMS_GATT_TEMP_HANDLE,
-		.ccc_handle = TTPMS_GATT_TEMP_HANDLE + 1,	// see note in ttpms_common.h
-};
+K_THREAD_DEFINE(TTPMS_notify_thread_id, CONFIG_TTPMS_NOTIFY_THREAD_STACK_SIZE, TTPMS_notify_thread, NULL, NULL, NULL,
+		CONFIG_TTPMS_NOTIFY_THREAD_PRIORITY, 0, 0);
+
+void TTPMS_notify_log_stats(void)
+{
+	size_t unused = 0;
 
+	k_thread_stack_space_get(TTPMS_notify_thread_id, &unused);
+	LOG_INF("Notify callbacks: longest %u us, ring high-water mark %ld/%d, dropped %ld, thread stack used %zu/%d bytes",
+		k_cyc_to_us_ceil32(atomic_get(&notify_cb_max_cycles)), atomic_get(&notify_hwm), CONFIG_TTPMS_NOTIFY_RING_DEPTH,
+		atomic_get(&notify_drops), CONFIG_TTPMS_NOTIFY_THREAD_STACK_SIZE - unused, CONFIG_TTPMS_NOTIFY_THREAD_STACK_SIZE);
+}
 
-void EFL_temp_subscribed_cb(struct bt_conn *conn, uint8_t err, struct bt_gatt_subscribe_params *params)
+static void temp_subscribed_cb(struct bt_conn *conn, uint8_t err, struct bt_gatt_subscribe_params *params)
 {
-	if(params->value == BT_GATT_CCC_NOTIFY) {
+	struct TTPMS_sensor *sensor = CONTAINER_OF(params, struct TTPMS_sensor, temp_subscribe_params);
 
-		atomic_set_bit(flags, EFL_SUBSCRIBED_FLAG);
-		LOG_INF("EFL_temp_subscribed_cb: subscribed");
+	if (err) {	// the BT stack dropped the subscription
+
+		atomic_clear_bit(flags, SUBSCRIBED_FLAG(sensor->index));
+		atomic_clear_bit(&sensor->streams, TTPMS_STREAM_TEMP);
+		LOG_WRN("%s temp_subscribed_cb: failed (err %u)", sensor->name, err);
+		TTPMS_supervisor_failed(sensor->index);
+
+	} else if(params->value == BT_GATT_CCC_NOTIFY) {
+
+		atomic_set_bit(flags, SUBSCRIBED_FLAG(sensor->index));
+		atomic_set_bit(&sensor->streams, TTPMS_STREAM_TEMP);
+		LOG_INF("%s temp_subscribed_cb: subscribed", sensor->name);
 
 	} else if (params->value == 0) {
 
-		atomic_clear_bit(flags, EFL_SUBSCRIBED_FLAG);
-		LOG_INF("EFL_temp_subscribed_cb: unsubscribed");
+		atomic_clear_bit(flags, SUBSCRIBED_FLAG(sensor->index));
+		atomic_clear_bit(&sensor->streams, TTPMS_STREAM_TEMP);
+		LOG_INF("%s temp_subscribed_cb: unsubscribed", sensor->name);
+		TTPMS_supervisor_kick(sensor->index);	// may be wanted again by now
 
 	} else {
-		LOG_WRN("EFL_temp_subscribed_cb: unknown CCC value");
+		LOG_WRN("%s temp_subscribed_cb: unknown CCC value", sensor->name);
 	}
+
+	TTPMS_link_settle(sensor);
 }
 
-uint8_t EFL_temp_notify_cb(struct bt_conn *conn, struct bt_gatt_subscribe_params *params, const void *data, uint16_t length)
+static uint8_t temp_notify_cb(struct bt_conn *conn, struct bt_gatt_subscribe_params *params, const void *data, uint16_t length)
 {
-	
-	if (data == NULL){	// When successfully unsubscribed, (or if unpurposefully unsubscribed?), notify callback is called one last time with data set to NULL (from Zephyr docs)
-		LOG_INF("EFL_temp_notify_cb: unsubscribed");
-		atomic_clear_bit(flags, EFL_SUBSCRIBED_FLAG);
+	struct TTPMS_sensor *sensor = CONTAINER_OF(params, struct TTPMS_sensor, temp_subscribe_params);
+	uint32_t start = k_cycle_get_32();
+
+	if (data == NULL) {	// When successfully unsubscribed, (or if unpurposefully unsubscribed?), notify callback is called one last time with data set to NULL (from Zephyr docs)
+		TTPMS_notify_log(sensor, TTPMS_NOTIFY_LOG_TEMP_UNSUBSCRIBED);
+		atomic_clear_bit(flags, SUBSCRIBED_FLAG(sensor->index));
+		atomic_clear_bit(&sensor->streams, TTPMS_STREAM_TEMP);
+		TTPMS_link_settle(sensor);
+		TTPMS_notify_cb_time(start);
 		return BT_GATT_ITER_STOP;
 	}
 
-	if (!atomic_test_bit(flags, TEMP_ENABLED_FLAG)) {	// if temp is not enabled, we need to unsubscribe
-		LOG_INF("EFL_temp_notify_cb: attempting to unsubscribe");
+	if (!TTPMS_BLE_want_temp(sensor)) {	// if neither temp (nor pressure carried with it) is enabled, we need to unsubscribe
+		TTPMS_notify_log(sensor, TTPMS_NOTIFY_LOG_TEMP_UNSUBSCRIBING);
+		TTPMS_notify_cb_time(start);
 		return BT_GATT_ITER_STOP;	// returning this tells the BT Host to unsubscribe us
 	}
 
-	if (length != 32) {
-		LOG_ERR("EFL_temp_notify_cb: Invalid data received from notification");
-		return BT_GATT_ITER_CONTINUE;
-	}
-	
-	//LOG_INF("EFL_temp_notify_cb: Notification received");
-
-	// fill CAN frames with data
-	for (int i = 0; i < 8; i++)
-	{
-		EFL_temp_1.data[i] = ((uint8_t *)data)[i];
-	}
-	for (int i = 0; i < 8; i++)
-	{
-		EFL_temp_2.data[i] = ((uint8_t *)data)[8 + i];
-	}
-	for (int i = 0; i < 8; i++)
-	{
-		EFL_temp_3.data[i] = ((uint8_t *)data)[16 + i];
-	}
-	for (int i = 0; i < 8; i++)
-	{
-		EFL_temp_4.data[i] = ((uint8_t *)data)[24 + i];
-	}
+	// decoded by the notification thread, see notification hand-off
+	TTPMS_notify_put(sensor->index, TTPMS_NOTIFY_TEMP, data, length);
 
-	// let the system workqueue actually send the frames (can_send is blocking)
-	k_work_submit(&EFL_temp_CAN_tx_work);
+	TTPMS_notify_cb_time(start);
 
 	return BT_GATT_ITER_CONTINUE;	// stay subscribed
 }
 
-static struct bt_gatt_subscribe_params EFL_temp_subscribe_params = {
-		.value = BT_GATT_CCC_NOTIFY,
-		.notify = EFL_temp_notify_cb,
-		.subscribe = EFL_temp_subscribed_cb,
-		.value_handle = TTPMS_GATT_TEMP_HANDLE,
-		.ccc_handle = TTPMS_GATT_TEMP_HANDLE + 1,	// see note in ttpms_common.h
-};
+static void pressure_subscribed_cb(struct bt_conn *conn, uint8_t err, struct bt_gatt_subscribe_params *params)
+{
+	struct TTPMS_sensor *sensor = CONTAINER_OF(params, struct TTPMS_sensor, pressure_subscribe_params);
 
+	if (err) {	// the BT stack dropped the subscription
 
-void EFR_temp_subscribed_cb(struct bt_conn *conn, uint8_t err, struct bt_gatt_subscribe_params *params)
-{
-	if(params->value == BT_GATT_CCC_NOTIFY) {
+		atomic_clear_bit(flags, PRES_SUBSCRIBED_FLAG(sensor->index));
+		atomic_clear_bit(&sensor->streams, TTPMS_STREAM_PRESSURE);
+		LOG_WRN("%s pressure_subscribed_cb: failed (err %u)", sensor->name, err);
+		TTPMS_supervisor_failed(sensor->index);
 
-		atomic_set_bit(flags, EFR_SUBSCRIBED_FLAG);
-		LOG_INF("EFR_temp_subscribed_cb: subscribed");
+	} else if(params->value == BT_GATT_CCC_NOTIFY) {
+
+		atomic_set_bit(flags, PRES_SUBSCRIBED_FLAG(sensor->index));
+		atomic_set_bit(&sensor->streams, TTPMS_STREAM_PRESSURE);
+		LOG_INF("%s pressure_subscribed_cb: subscribed", sensor->name);
 
 	} else if (params->value == 0) {
 
-		atomic_clear_bit(flags, EFR_SUBSCRIBED_FLAG);
-		LOG_INF("EFR_temp_subscribed_cb: unsubscribed");
+		atomic_clear_bit(flags, PRES_SUBSCRIBED_FLAG(sensor->index));
+		atomic_clear_bit(&sensor->streams, TTPMS_STREAM_PRESSURE);
+		LOG_INF("%s pressure_subscribed_cb: unsubscribed", sensor->name);
+		TTPMS_supervisor_kick(sensor->index);	// may be wanted again by now
 
 	} else {
-		LOG_WRN("EFR_temp_subscribed_cb: unknown CCC value");
+		LOG_WRN("%s pressure_subscribed_cb: unknown CCC value", sensor->name);
 	}
+
+	TTPMS_link_settle(sensor);
 }
 
-uint8_t EFR_temp_notify_cb(struct bt_conn *conn, struct bt_gatt_subscribe_params *params, const void *data, uint16_t length)
+static uint8_t pressure_notify_cb(struct bt_conn *conn, struct bt_gatt_subscribe_params *params, const void *data, uint16_t length)
 {
-	
-	if (data == NULL){	// When successfully unsubscribed, (or if unpurposefully unsubscribed?), notify callback is called one last time with data set to NULL (from Zephyr docs)
-		LOG_INF("EFR_temp_notify_cb: unsubscribed");
-		atomic_clear_bit(flags, EFR_SUBSCRIBED_FLAG);
+	struct TTPMS_sensor *sensor = CONTAINER_OF(params, struct TTPMS_sensor, pressure_subscribe_params);
+	uint32_t start = k_cycle_get_32();
+
+	if (data == NULL) {	// see temp_notify_cb
+		TTPMS_notify_log(sensor, TTPMS_NOTIFY_LOG_PRES_UNSUBSCRIBED);
+		atomic_clear_bit(flags, PRES_SUBSCRIBED_FLAG(sensor->index));
+		atomic_clear_bit(&sensor->streams, TTPMS_STREAM_PRESSURE);
+		TTPMS_link_settle(sensor);
+		TTPMS_notify_cb_time(start);
 		return BT_GATT_ITER_STOP;
 	}
 
-	if (!atomic_test_bit(flags, TEMP_ENABLED_FLAG)) {	// if temp is not enabled, we need to unsubscribe
-		LOG_INF("EFR_temp_notify_cb: attempting to unsubscribe");
-		return BT_GATT_ITER_STOP;	// returning this tells the BT Host to unsubscribe us
-	}
-
-	if (length != 32) {
-		LOG_ERR("EFR_temp_notify_cb: Invalid data received from notification");
-		return BT_GATT_ITER_CONTINUE;
+	if (!atomic_test_bit(flags, PRESSURE_ENABLED_FLAG)) {	// if pressure is not enabled, we need to unsubscribe
+		TTPMS_notify_log(sensor, TTPMS_NOTIFY_LOG_PRES_UNSUBSCRIBING);
+		TTPMS_notify_cb_time(start);
+		return BT_GATT_ITER_STOP;
 	}
-	
-	//LOG_INF("EFR_temp_notify_cb: Notification received");
 
-	// fill CAN frames with data
-	for (int i = 0; i < 8; i++)
-	{
-		EFR_temp_1.data[i] = ((uint8_t *)data)[i];
-	}
-	for (int i = 0; i < 8; i++)
-	{
-		EFR_temp_2.data[i] = ((uint8_t *)data)[8 + i];
-	}
-	for (int i = 0; i < 8; i++)
-	{
-		EFR_temp_3.data[i] = ((uint8_t *)data)[16 + i];
-	}
-	for (int i = 0; i < 8; i++)
-	{
-		EFR_temp_4.data[i] = ((uint8_t *)data)[24 + i];
-	}
+	TTPMS_notify_put(sensor->index, TTPMS_NOTIFY_PRESSURE, data, length);
 
-	// let the system workqueue actually send the frames (can_send is blocking)
-	k_work_submit(&EFR_temp_CAN_tx_work);
+	TTPMS_notify_cb_time(start);
 
 	return BT_GATT_ITER_CONTINUE;	// stay subscribed
 }
 
-static struct bt_gatt_subscribe_params EFR_temp_subscribe_params = {
-		.value = BT_GATT_CCC_NOTIFY,
-		.notify = EFR_temp_notify_cb,
-		.subscribe = EFR_temp_subscribed_cb,
-		.value_handle = TTPMS_GATT_TEMP_HANDLE,
-		.ccc_handle = TTPMS_GATT_TEMP_HANDLE + 1,	// see note in ttpms_common.h
-};
-
-void ERL_temp_subscribed_cb(struct bt_conn *conn, uint8_t err, struct bt_gatt_subscribe_params *params)
+// Subscribe to temp or pressure notifications of a connected sensor
+static int TTPMS_BLE_subscribe(struct TTPMS_sensor *sensor, struct bt_gatt_subscribe_params *params, int flag, const char *what)
 {
-	if(params->value == BT_GATT_CCC_NOTIFY) {
+	int err;
 
-		atomic_set_bit(flags, ERL_SUBSCRIBED_FLAG);
-		LOG_INF("ERL_temp_subscribed_cb: subscribed");
+	// bt_gatt_subscribe is not blocking, so if we don't set this here, we may try to subscribe twice!
+	if (atomic_test_and_set_bit(flags, flag)) {
+		return 0;
+	}
 
-	} else if (params->value == 0) {
+	// main only checked the connected flag, the sensor may have disconnected since (see TTPMS_sensor_conn)
+	struct bt_conn *conn = TTPMS_sensor_conn(sensor);
 
-		atomic_clear_bit(flags, ERL_SUBSCRIBED_FLAG);
-		LOG_INF("ERL_temp_subscribed_cb: unsubscribed");
+	if (!conn) {
+		atomic_clear_bit(flags, flag);
+		return -ENOTCONN;
+	}
 
+	LOG_INF("Attempting to subscribe to %s %s", sensor->name, what);
+	params->value = BT_GATT_CCC_NOTIFY;	// this gets changed to 0 by the BT stack after an unsubscription event, need to set it back
+	err = bt_gatt_subscribe(conn, params);
+	bt_conn_unref(conn);
+	if (err) {
+		LOG_WRN("Failed to subscribe to %s %s (err %d)", sensor->name, what, err);
+		atomic_clear_bit(flags, flag);	// see note above. must clear if we actually didn't subscribe
 	} else {
-		LOG_WRN("ERL_temp_subscribed_cb: unknown CCC value");
+		TTPMS_link_set(sensor, TTPMS_LINK_SUBSCRIBING);
 	}
+
+	return err;
 }
 
-uint8_t ERL_temp_notify_cb(struct bt_conn *conn, struct bt_gatt_subscribe_params *params, const void *data, uint16_t length)
+// Make sure a connected sensor is subscribed to what is enabled
+// Write the sensor's mode characteristic (CONFIG_TTPMS_SENSOR_IDLE_MODE), only when it changes
+static void TTPMS_BLE_set_mode(struct TTPMS_sensor *sensor, uint8_t mode)
 {
-	
-	if (data == NULL) {	// When successfully unsubscribed, (or if unpurposefully unsubscribed?), notify callback is called one last time with data set to NULL (from Zephyr docs)
-		LOG_INF("ERL_temp_notify_cb: unsubscribed");
-		atomic_clear_bit(flags, ERL_SUBSCRIBED_FLAG);
-		return BT_GATT_ITER_STOP;
-	}
+	struct bt_conn *conn;
+	int err;
 
-	if (!atomic_test_bit(flags, TEMP_ENABLED_FLAG)) {	// if temp is not enabled, we need to unsubscribe
-		LOG_INF("ERL_temp_notify_cb: attempting to unsubscribe");
-		return BT_GATT_ITER_STOP;	// returning this tells the BT Host to unsubscribe us
+	if (!IS_ENABLED(CONFIG_TTPMS_SENSOR_IDLE_MODE) || sensor->mode_handle == 0 || sensor->mode == mode) {
+		return;
 	}
 
-	if (length != 16) {
-		LOG_ERR("ERL_temp_notify_cb: Invalid data received from notification");
-		return BT_GATT_ITER_CONTINUE;
+	conn = TTPMS_sensor_conn(sensor);
+	if (!conn) {
+		return;
 	}
-	
-	//LOG_INF("ERL_temp_notify_cb: Notification received");
 
-	// fill CAN frames with data
-	for (int i = 0; i < 8; i++)
-	{
-		ERL_temp_1.data[i] = ((uint8_t *)data)[i];
-	}
-	for (int i = 0; i < 8; i++)
-	{
-		ERL_temp_2.data[i] = ((uint8_t *)data)[8 + i];
+	err = bt_gatt_write_without_response(conn, sensor->mode_handle, &mode, sizeof(mode), false);
+	bt_conn_unref(conn);
+	if (err) {
+		LOG_WRN("%s: Failed to write mode (err %d)", sensor->name, err);	// tried again on the next update
+		return;
 	}
 
-	// let the system workqueue actually send the frames (can_send is blocking)
-	k_work_submit(&ERL_temp_CAN_tx_work);
-
-	return BT_GATT_ITER_CONTINUE;	// stay subscribed
+	sensor->mode = mode;
+	LOG_INF("%s: %s mode", sensor->name, (mode == TTPMS_MODE_IDLE) ? "idle" : "streaming");
 }
 
-static struct bt_gatt_subscribe_params ERL_temp_subscribe_params = {
-		.value = BT_GATT_CCC_NOTIFY,
-		.notify = ERL_temp_notify_cb,
-		.subscribe = ERL_temp_subscribed_cb,
-		.value_handle = TTPMS_GATT_TEMP_HANDLE,
-		.ccc_handle = TTPMS_GATT_TEMP_HANDLE + 1,	// see note in ttpms_common.h
-};
-
-
-void ERR_temp_subscribed_cb(struct bt_conn *conn, uint8_t err, struct bt_gatt_subscribe_params *params)
+static int TTPMS_BLE_unsubscribe(struct TTPMS_sensor *sensor, struct bt_gatt_subscribe_params *params, int flag, const char *what)
 {
-	if(params->value == BT_GATT_CCC_NOTIFY) {
-
-		atomic_set_bit(flags, ERR_SUBSCRIBED_FLAG);
-		LOG_INF("ERR_temp_subscribed_cb: subscribed");
+	struct bt_conn *conn;
+	int err;
 
-	} else if (params->value == 0) {
+	// bt_gatt_unsubscribe sets value to 0, so this is only done once (the flag is cleared by the callbacks when it's done)
+	if (!atomic_test_bit(flags, flag) || params->value == 0) {
+		return 0;
+	}
 
-		atomic_clear_bit(flags, ERR_SUBSCRIBED_FLAG);
-		LOG_INF("ERR_temp_subscribed_cb: unsubscribed");
+	conn = TTPMS_sensor_conn(sensor);
+	if (!conn) {
+		return 0;	// the disconnect drops the subscription anyway
+	}
 
+	LOG_INF("Attempting to unsubscribe from %s %s", sensor->name, what);
+	err = bt_gatt_unsubscribe(conn, params);
+	bt_conn_unref(conn);
+	if (err) {
+		LOG_WRN("Failed to unsubscribe from %s %s (err %d)", sensor->name, what, err);	// e.g. subscribe still in flight
 	} else {
-		LOG_WRN("ERR_temp_subscribed_cb: unknown CCC value");
+		TTPMS_link_set(sensor, TTPMS_LINK_UNSUBSCRIBING);
 	}
+
+	return err;
 }
 
-uint8_t ERR_temp_notify_cb(struct bt_conn *conn, struct bt_gatt_subscribe_params *params, const void *data, uint16_t length)
+// Subscribe to what is enabled and unsubscribe from the rest, returns an error if any (un)subscribe failed.
+// Only called by main (see supervisor).
+static int TTPMS_BLE_update_subscriptions(struct TTPMS_sensor *sensor)
 {
-	
-	if (data == NULL){	// When successfully unsubscribed, (or if unpurposefully unsubscribed?), notify callback is called one last time with data set to NULL (from Zephyr docs)
-		LOG_INF("ERR_temp_notify_cb: unsubscribed");
-		atomic_clear_bit(flags, ERR_SUBSCRIBED_FLAG);
-		return BT_GATT_ITER_STOP;
-	}
+	bool want_pressure;
+	int pressure_err;
+	int err = 0;
 
-	if (!atomic_test_bit(flags, TEMP_ENABLED_FLAG)) {	// if temp is not enabled, we need to unsubscribe
-		LOG_INF("ERR_temp_notify_cb: attempting to unsubscribe");
-		return BT_GATT_ITER_STOP;	// returning this tells the BT Host to unsubscribe us
+	if (sensor->gatt_state != TTPMS_GATT_READY) {	// handles not known yet, kicked again when they are
+		return 0;
 	}
 
-	if (length != 16) {
-		LOG_ERR("ERR_temp_notify_cb: Invalid data received from notification");
-		return BT_GATT_ITER_CONTINUE;
+	if (!TTPMS_BLE_want_temp(sensor)) {
+		err = TTPMS_BLE_unsubscribe(sensor, &sensor->temp_subscribe_params, SUBSCRIBED_FLAG(sensor->index), "temp");
+		TTPMS_BLE_set_mode(sensor, TTPMS_MODE_IDLE);
+	} else if (sensor->temp_subscribe_params.ccc_handle) {
+		TTPMS_BLE_set_mode(sensor, TTPMS_MODE_STREAMING);
+		err = TTPMS_BLE_subscribe(sensor, &sensor->temp_subscribe_params, SUBSCRIBED_FLAG(sensor->index), "temp");
 	}
-	
-	//LOG_INF("ERR_temp_notify_cb: Notification received");
 
-	// fill CAN frames with data
-	for (int i = 0; i < 8; i++)
-	{
-		ERR_temp_1.data[i] = ((uint8_t *)data)[i];
-	}
-	for (int i = 0; i < 8; i++)
-	{
-		ERR_temp_2.data[i] = ((uint8_t *)data)[8 + i];
+	// sensors without a pressure characteristic (handle 0), or that send it combined with temp, don't get a separate subscription
+	if (!sensor->pressure_frame_id || !sensor->pressure_subscribe_params.ccc_handle) {
+		return err;
 	}
 
-	// let the system workqueue actually send the frames (can_send is blocking)
-	k_work_submit(&ERR_temp_CAN_tx_work);
+	want_pressure = !TTPMS_COMBINED(sensor) && atomic_test_bit(flags, PRESSURE_ENABLED_FLAG);
 
-	return BT_GATT_ITER_CONTINUE;	// stay subscribed
-}
+	if (!want_pressure) {
+		pressure_err = TTPMS_BLE_unsubscribe(sensor, &sensor->pressure_subscribe_params, PRES_SUBSCRIBED_FLAG(sensor->index), "pressure");
+	} else {
+		pressure_err = TTPMS_BLE_subscribe(sensor, &sensor->pressure_subscribe_params, PRES_SUBSCRIBED_FLAG(sensor->index), "pressure");
+	}
 
-static struct bt_gatt_subscribe_params ERR_temp_subscribe_params = {
-		.value = BT_GATT_CCC_NOTIFY,
-		.notify = ERR_temp_notify_cb,
-		.subscribe = ERR_temp_subscribed_cb,
-		.value_handle = TTPMS_GATT_TEMP_HANDLE,
-		.ccc_handle = TTPMS_GATT_TEMP_HANDLE + 1,	// see note in ttpms_common.h
-};
+	return err ? err : pressure_err;
+}
 
-// NOTE: each sensor needs to have its own subscribe_params variable since it remains tied to each subscription (from Zephyr docs)
+// Temp/pressure were turned on or off via CAN, (un)subscribe all links now. Called from the CAN RX callback.
+void TTPMS_BLE_settings_changed(void)
+{
+	atomic_or(&supervisor_sensors, BIT_MASK(TTPMS_NUM_SENSORS));
+	TTPMS_supervisor_post(TTPMS_EVT_SUBSCRIBE);
+}
 
 void TTPMS_BLE_init(void)
 {
@@ -815,70 +3639,105 @@ void TTPMS_BLE_init(void)
 		LOG_WRN("Bluetooth init failed (err %d)", err);
 	} else {
 		LOG_INF("Bluetooth initialized");
+		TTPMS_qos_reports_enable();
+	}
+
+	for (int i = 0; i < TTPMS_NUM_SENSORS; i++) {
+		k_work_init(&sensors[i].cache_save_work, TTPMS_gatt_cache_save_work_handler);
 	}
 
-	// fill address variables for the devices we want to filter for
-	err = bt_addr_le_from_str(TTPMS_IFL_BT_ID, "random", &IFL_bt_addr);
-	if (err) { LOG_WRN("Invalid BT address (err %d)", err); }
+	err = settings_subsys_init();
+	if (err) {
+		LOG_WRN("Settings init failed, addresses and GATT handles won't be saved (err %d)", err);
+	}
 
-	err = bt_addr_le_from_str(TTPMS_IFR_BT_ID, "random", &IFR_bt_addr);
-	if (err) { LOG_WRN("Invalid BT address (err %d)", err); }
+	// sensor addresses and filter accept list
+	TTPMS_addr_load(err == 0);
 
-	err = bt_addr_le_from_str(TTPMS_IRL_BT_ID, "random", &IRL_bt_addr);
-	if (err) { LOG_WRN("Invalid BT address (err %d)", err); }
+	// load the cached GATT handles (needs the addresses above)
+	if (err == 0) {
+		settings_load_subtree(TTPMS_GATT_CACHE_SUBTREE);
+	}
 
-	err = bt_addr_le_from_str(TTPMS_IRR_BT_ID, "random", &IRR_bt_addr);
-	if (err) { LOG_WRN("Invalid BT address (err %d)", err); }
+	// start looking for all sensors
+	k_work_init_delayable(&conn_mgr_work, TTPMS_conn_mgr_work_handler);
+	k_work_schedule(&conn_mgr_work, K_NO_WAIT);
 
-	err = bt_addr_le_from_str(TTPMS_EFL_BT_ID, "random", &EFL_bt_addr);
-	if (err) { LOG_WRN("Invalid BT address (err %d)", err); }
+	k_work_init_delayable(&conn_param_work, TTPMS_conn_param_work_handler);
+	k_work_schedule(&conn_param_work, K_MSEC(CONFIG_TTPMS_CONN_ADAPT_MS));
 
-	err = bt_addr_le_from_str(TTPMS_EFR_BT_ID, "random", &EFR_bt_addr);
-	if (err) { LOG_WRN("Invalid BT address (err %d)", err); }
+	k_work_init_delayable(&link_check_work, TTPMS_link_check_work_handler);
+	k_work_schedule(&link_check_work, K_MSEC(CONFIG_TTPMS_LINK_CHECK_MS));
 
-	err = bt_addr_le_from_str(TTPMS_ERL_BT_ID, "random", &ERL_bt_addr);
-	if (err) { LOG_WRN("Invalid BT address (err %d)", err); }
+	memset(chan_quality, TTPMS_CHAN_NO_DATA, sizeof(chan_quality));
+	k_work_init_delayable(&chan_map_work, TTPMS_chan_map_work_handler);
+	k_work_schedule(&chan_map_work, K_MSEC(CONFIG_TTPMS_CHAN_MAP_MS));
+}
 
-	err = bt_addr_le_from_str(TTPMS_ERR_BT_ID, "random", &ERR_bt_addr);
-	if (err) { LOG_WRN("Invalid BT address (err %d)", err); }
+/* --- BLE STUFF END --- */
 
-	
-	// Add address of the devices we want to filter accept list
-	err = bt_le_filter_accept_list_add(&IFL_bt_addr);
-	if (err) { LOG_WRN("Failed to add address to filter accept list (err %d)", err); }
 
-	err = bt_le_filter_accept_list_add(&IFR_bt_addr);
-	if (err) { LOG_WRN("Failed to add address to filter accept list (err %d)", err); }
 
-	err = bt_le_filter_accept_list_add(&IRL_bt_addr);
-	if (err) { LOG_WRN("Failed to add address to filter accept list (err %d)", err); }
+/* supervisor (main) */
 
-	err = bt_le_filter_accept_list_add(&IRR_bt_addr);
-	if (err) { LOG_WRN("Failed to add address to filter accept list (err %d)", err); }
+static void TTPMS_supervisor_timer_cb(struct k_timer *timer)
+{
+	TTPMS_supervisor_post((atomic_val_t)k_timer_user_data_get(timer));
+}
 
-	err = bt_le_filter_accept_list_add(&EFL_bt_addr);
-	if (err) { LOG_WRN("Failed to add address to filter accept list (err %d)", err); }
+K_TIMER_DEFINE(diag_timer, TTPMS_supervisor_timer_cb, NULL);
+K_TIMER_DEFINE(status_timer, TTPMS_supervisor_timer_cb, NULL);
+K_TIMER_DEFINE(stats_timer, TTPMS_supervisor_timer_cb, NULL);
 
-	err = bt_le_filter_accept_list_add(&EFR_bt_addr);
-	if (err) { LOG_WRN("Failed to add address to filter accept list (err %d)", err); }
+static void TTPMS_supervisor_start_timer(struct k_timer *timer, atomic_val_t event, uint32_t period_ms)
+{
+	k_timer_user_data_set(timer, (void *)event);
+	k_timer_start(timer, K_MSEC(period_ms), K_MSEC(period_ms));
+}
 
-	err = bt_le_filter_accept_list_add(&ERL_bt_addr);
-	if (err) { LOG_WRN("Failed to add address to filter accept list (err %d)", err); }
+// Check the kicked sensors and those due for a retry, returns the time until the next retry (K_FOREVER if none)
+static k_timeout_t TTPMS_supervisor_subscriptions(void)
+{
+	atomic_val_t check = atomic_clear(&supervisor_sensors);
+	atomic_val_t failed = atomic_clear(&supervisor_failed);
+	uint32_t now = k_uptime_get_32();
+	int32_t next = INT32_MAX;
+
+	for (int i = 0; i < TTPMS_NUM_SENSORS; i++) {
+		struct TTPMS_sensor *sensor = &sensors[i];
+		bool fail = failed & BIT(i);
+
+		if (!atomic_test_bit(flags, CONNECTED_FLAG(sensor->position))) {
+			sensor->retry_at = 0;
+			sensor->retry_ms = 0;
+			continue;
+		}
 
-	err = bt_le_filter_accept_list_add(&ERR_bt_addr);
-	if (err) { LOG_WRN("Failed to add address to filter accept list (err %d)", err); }
+		if (sensor->retry_at && (int32_t)(now - sensor->retry_at) >= 0) {
+			sensor->retry_at = 0;
+			check |= BIT(i);
+		}
 
-	scan_param.interval = BT_GAP_SCAN_FAST_INTERVAL;
-	scan_param.window = BT_GAP_SCAN_FAST_WINDOW;
-	err = bt_conn_le_create_auto(&scan_param, &conn_param);
-	if (err) {
-		LOG_ERR("Failed to start automatically connecting (err %d)", err);
-	}
-}
+		if (!fail && (check & BIT(i)) && !sensor->retry_at) {
+			fail = TTPMS_BLE_update_subscriptions(sensor) != 0;
+			if (!fail) {
+				sensor->retry_ms = 0;
+			}
+		}
 
-/* --- BLE STUFF END --- */
+		if (fail && !sensor->retry_at) {
+			sensor->retry_ms = CLAMP(2 * sensor->retry_ms, TTPMS_RETRY_MIN_MS, TTPMS_RETRY_MAX_MS);
+			sensor->retry_at = MAX(now + sensor->retry_ms, 1);
+			LOG_INF("%s: retrying subscriptions in %u ms", sensor->name, sensor->retry_ms);
+		}
 
+		if (sensor->retry_at) {
+			next = MIN(next, MAX((int32_t)(sensor->retry_at - now), 0));
+		}
+	}
 
+	return (next == INT32_MAX) ? K_FOREVER : K_MSEC(next);
+}
 
 void main(void)
 {
@@ -890,100 +3749,43 @@ void main(void)
 
 	TTPMS_BLE_init();
 
-	int err;
-
-	struct bt_conn *conn;
+	uint8_t status[TTPMS_STATUS_LEN];
+	k_timeout_t retry = K_FOREVER;
 
-	int counter = 0;
+	TTPMS_supervisor_start_timer(&diag_timer, TTPMS_EVT_DIAG, 100);
+	TTPMS_supervisor_start_timer(&status_timer, TTPMS_EVT_STATUS, 500);
+	TTPMS_supervisor_start_timer(&stats_timer, TTPMS_EVT_STATS, 10000);
 
 	while(1)
 	{
-		
-		if (atomic_test_bit(flags, TEMP_ENABLED_FLAG))	{ // if temp is enabled, make sure we are subscribed to all connected sensors
-
-			if (atomic_test_bit(flags, IFL_CONNECTED_FLAG) && !atomic_test_bit(flags, IFL_SUBSCRIBED_FLAG)) // if connected and not subscribed, we need to subscribe
-			{
-				LOG_INF("main: Attempting to subscribe to IFL temp");
-				IFL_temp_subscribe_params.value = BT_GATT_CCC_NOTIFY;	// this gets changed to 0 by the BT stack after an unsubscription event, need to set it back
-				atomic_set_bit(flags, IFL_SUBSCRIBED_FLAG);	// bt_gatt_subscribe is not blocking, so if we don't set this here, we may try to subscribe twice!
-				conn = bt_conn_lookup_addr_le(bt_identity, &IFL_bt_addr);
-				err = bt_gatt_subscribe(conn, &IFL_temp_subscribe_params);
-				if (err) {
-					LOG_WRN("main: Failed to subscribe to IFL temp (err %d)", err);
-					atomic_clear_bit(flags, IFL_SUBSCRIBED_FLAG);	// see note above. must clear if we actually didn't subscribe
-				}
-				bt_conn_unref(conn);
-			}
+		atomic_val_t events;
 
-			if (atomic_test_bit(flags, EFL_CONNECTED_FLAG) && !atomic_test_bit(flags, EFL_SUBSCRIBED_FLAG)) // if connected and not subscribed, we need to subscribe
-			{
-				LOG_INF("main: Attempting to subscribe to EFL temp");
-				EFL_temp_subscribe_params.value = BT_GATT_CCC_NOTIFY;	// this gets changed to 0 by the BT stack after an unsubscription event, need to set it back
-				atomic_set_bit(flags, EFL_SUBSCRIBED_FLAG);	// bt_gatt_subscribe is not blocking, so if we don't set this here, we may try to subscribe twice!
-				conn = bt_conn_lookup_addr_le(bt_identity, &EFL_bt_addr);
-				err = bt_gatt_subscribe(conn, &EFL_temp_subscribe_params);
-				if (err) {
-					LOG_WRN("main: Failed to subscribe to EFL temp (err %d)", err);
-					atomic_clear_bit(flags, EFL_SUBSCRIBED_FLAG);	// see note above. must clear if we actually didn't subscribe
-				}
-				bt_conn_unref(conn);
-			}
+		k_sem_take(&supervisor_sem, retry);	// timing out means a retry is due
+		events = atomic_clear(&supervisor_events);
 
-			if (atomic_test_bit(flags, EFR_CONNECTED_FLAG) && !atomic_test_bit(flags, EFR_SUBSCRIBED_FLAG)) // if connected and not subscribed, we need to subscribe
-			{
-				LOG_INF("main: Attempting to subscribe to EFR temp");
-				EFR_temp_subscribe_params.value = BT_GATT_CCC_NOTIFY;	// this gets changed to 0 by the BT stack after an unsubscription event, need to set it back
-				atomic_set_bit(flags, EFR_SUBSCRIBED_FLAG);	// bt_gatt_subscribe is not blocking, so if we don't set this here, we may try to subscribe twice!
-				conn = bt_conn_lookup_addr_le(bt_identity, &EFR_bt_addr);
-				err = bt_gatt_subscribe(conn, &EFR_temp_subscribe_params);
-				if (err) {
-					LOG_WRN("main: Failed to subscribe to EFR temp (err %d)", err);
-					atomic_clear_bit(flags, EFR_SUBSCRIBED_FLAG);	// see note above. must clear if we actually didn't subscribe
-				}
-				bt_conn_unref(conn);
-			}
+		// make sure connected sensors are subscribed to what is enabled (and only that)
+		retry = TTPMS_supervisor_subscriptions();
 
-			if (atomic_test_bit(flags, ERL_CONNECTED_FLAG) && !atomic_test_bit(flags, ERL_SUBSCRIBED_FLAG)) // if connected and not subscribed, we need to subscribe
-			{
-				LOG_INF("main: Attempting to subscribe to ERL temp");
-				ERL_temp_subscribe_params.value = BT_GATT_CCC_NOTIFY;	// this gets changed to 0 by the BT stack after an unsubscription event, need to set it back
-				atomic_set_bit(flags, ERL_SUBSCRIBED_FLAG);	// bt_gatt_subscribe is not blocking, so if we don't set this here, we may try to subscribe twice!
-				conn = bt_conn_lookup_addr_le(bt_identity, &ERL_bt_addr);
-				err = bt_gatt_subscribe(conn, &ERL_temp_subscribe_params);
-				if (err) {
-					LOG_WRN("main: Failed to subscribe to ERL temp (err %d)", err);
-					atomic_clear_bit(flags, ERL_SUBSCRIBED_FLAG);	// see note above. must clear if we actually didn't subscribe
-				}
-				bt_conn_unref(conn);
-			}
+		if (events & TTPMS_EVT_DIAG) {
+			TTPMS_scan_stats_sample();
+			TTPMS_CAN_send_diag();	// one diagnostics row every 100ms, full table every 6.3 seconds
+		}
 
-			if (atomic_test_bit(flags, ERR_CONNECTED_FLAG) && !atomic_test_bit(flags, ERR_SUBSCRIBED_FLAG)) // if connected and not subscribed, we need to subscribe
-			{
-				LOG_INF("main: Attempting to subscribe to ERR temp");
-				ERR_temp_subscribe_params.value = BT_GATT_CCC_NOTIFY;	// this gets changed to 0 by the BT stack after an unsubscription event, need to set it back
-				atomic_set_bit(flags, ERR_SUBSCRIBED_FLAG);	// bt_gatt_subscribe is not blocking, so if we don't set this here, we may try to subscribe twice!
-				conn = bt_conn_lookup_addr_le(bt_identity, &ERR_bt_addr);
-				err = bt_gatt_subscribe(conn, &ERR_temp_subscribe_params);
-				if (err) {
-					LOG_WRN("main: Failed to subscribe to ERR temp (err %d)", err);
-					atomic_clear_bit(flags, ERR_SUBSCRIBED_FLAG);	// see note above. must clear if we actually didn't subscribe
-				}
-				bt_conn_unref(conn);
-			}
+		if (events & TTPMS_EVT_STATUS) {		// send out TTPMS status message to dash every 500ms
+			status[0] = (atomic_test_bit(flags, TEMP_ENABLED_FLAG) | (atomic_test_bit(flags, PRESSURE_ENABLED_FLAG) << 1));
+			status[1] = (atomic_get(flags) & 0xFF);	// connected flags, one bit per position
+			sys_put_le16(TTPMS_CAN_bus_load(), &status[2]);
+			TTPMS_CAN_queue_sample(TTPMS_RX_SELF, TTPMS_STATUS_FRAME_ID, status, sizeof(status));
+		}
 
-		} 
-		// NOTE: the notify callbacks will unsubscribe themselves if they see that temp is not enabled
-	
-		k_sleep(K_MSEC(100));
+		if (events & TTPMS_EVT_NOTIFY_LOG) {
+			TTPMS_notify_log_flush();
+		}
 
-		counter++;
-		if (counter >= 5) {		// send out TTPMS status message to dash every 500ms
-			counter = 0;
-			TTPMS_status.data[0] = (atomic_test_bit(flags, TEMP_ENABLED_FLAG) | (atomic_test_bit(flags, PRESSURE_ENABLED_FLAG) << 1));
-			TTPMS_status.data[1] = (atomic_get(flags) & 0xFF);
-			k_work_submit(&status_CAN_tx_work);
+		if (events & TTPMS_EVT_STATS) {	// log CAN TX counters every 10s
+			TTPMS_CAN_log_stats();
+			TTPMS_BLE_log_stats();
 		}
-		
 	}
 	
 }
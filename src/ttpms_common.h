@@ -3,6 +3,7 @@
 
 // BLE addresses/identities
 // First hex char must be C for random static address (to self-assign identity)
+// The receiver only uses the sensor addresses as defaults: it keeps its own table in flash, which can be changed over CAN
 
 #define TTPMS_RX_BT_ID  "CA:69:F1:F1:69:69"		// Receiver BT ID
 #define TTPMS_IFL_BT_ID "CA:69:F1:F1:33:42"		// Internal Front Left BT ID
@@ -15,9 +16,9 @@
 #define TTPMS_ERR_BT_ID "CA:69:F1:F1:11:25"		// External Rear Right BT ID
 
 
-// GATT UUIDs and handles
-// If proper GATT discovery is used, the UUIDs are used to find the handles of the desired characteristic/attribute.
-// For simplicity, we will hardcode the handles.
+// GATT UUIDs
+// The receiver discovers the handles of the characteristics below by UUID (and caches them per sensor,
+// checked against the sensor's GATT Database Hash), so the sensor GATT table can change freely.
 
 #define TTPMS_BASE_UUID_PART_1	0x3022c87e
 #define TTPMS_BASE_UUID_PART_2	0x71b0
@@ -54,16 +55,19 @@
 													TTPMS_BASE_UUID_PART_4, \
 													TTPMS_BASE_UUID_PART_5 + 3	)
 
+// Base UUID + 4, used for the (optional) sensor mode GATT characteristic, written by the receiver (uint8_t)
+#define TTPMS_SERVICE_MODE_UUID BT_UUID_128_ENCODE(	TTPMS_BASE_UUID_PART_1, \
+													TTPMS_BASE_UUID_PART_2, \
+													TTPMS_BASE_UUID_PART_3, \
+													TTPMS_BASE_UUID_PART_4, \
+													TTPMS_BASE_UUID_PART_5 + 4	)
 
-// the below handles must be updated every time the GATT table declaration is changed in the sensor code
-
-#define TTPMS_GATT_BATT_HANDLE 		0x0		// not yet implemented
-#define TTPMS_GATT_TEMP_HANDLE 		0x12
-#define TTPMS_GATT_PRESSURE_HANDLE	0x0		// not yet implemented
+#define TTPMS_MODE_IDLE			0	// temp not wanted, sensor may measure at a low rate and stop notifying
+#define TTPMS_MODE_STREAMING	1	// normal operation
 
-// the pressure characteristic/handle is last so that the other handles are not changed for sensors that do not have pressure
 
-// for subscribable characteristics (temperature and pressure), the CCC handle is always
-// right after the value handle (value handle + 1). We can hardcode the + 1.
+// Pressure is a uint24_t little endian (3 bytes). With CONFIG_TTPMS_COMBINED_TEMP_PRESSURE the internal sensors
+// append it to their temp notification instead (16 temp bytes + 3 pressure bytes), so one notification carries both.
+#define TTPMS_PRESSURE_LEN			3
 
 #endif
\ No newline at end of file